@@ -0,0 +1,344 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "cacheddisk.h"
+
+CachedDisk::CachedDisk(IDiskDriver *disk, uint32_t pageCount) : disk(disk), clockHand(0), diskSize(0), addr(0) {
+    assert(disk != nullptr && "disk is NULL");
+    assert(pageCount >= 64 && "the cache is too small");
+    pool = static_cast<char *>(std::aligned_alloc(CACHE_PAGE_SIZE, static_cast<size_t>(pageCount) * CACHE_PAGE_SIZE));
+    assert(pool != nullptr && "could not allocate the cache");
+    pages.resize(pageCount, {0, false, false, false, false});
+}
+
+CachedDisk::~CachedDisk() {
+    close();
+    std::free(pool);
+    delete disk;
+}
+
+bool CachedDisk::diskExists(std::string name) {
+    return disk->diskExists(name);
+}
+
+void CachedDisk::open(std::string name) {
+    disk->open(name);
+    diskSize = disk->getSize();
+    dropPages();
+    addr = 0;
+}
+
+void CachedDisk::close() {
+    writeBack(0, diskSize);
+    dropPages();
+    disk->close();
+}
+
+void CachedDisk::create(std::string name, uint64_t size) {
+    disk->create(name, size);
+}
+
+void CachedDisk::setAddr(uint64_t addr) {
+    this->addr = addr;
+}
+
+void CachedDisk::write(const char *data, size_t size) {
+    writeAt(addr, data, size);
+    addr += size;
+}
+
+void CachedDisk::read(char *buffer, size_t size) {
+    readAt(addr, buffer, size);
+    addr += size;
+}
+
+uint64_t CachedDisk::getSize() {
+    return diskSize;
+}
+
+void CachedDisk::sync() {
+    std::unique_lock<std::mutex> lock(mutex);
+    writeBack(0, diskSize);
+    lock.unlock();
+    disk->sync();
+}
+
+void CachedDisk::readAt(uint64_t addr, char *buffer, size_t size) {
+    transfer({{addr, buffer, size}}, false);
+}
+
+void CachedDisk::writeAt(uint64_t addr, const char *data, size_t size) {
+    transfer({{addr, const_cast<char *>(data), size}}, true);
+}
+
+void CachedDisk::readv(const std::vector<IOVec_t> &requests) {
+    transfer(requests, false);
+}
+
+void CachedDisk::writev(const std::vector<IOVec_t> &requests) {
+    transfer(requests, true);
+}
+
+const char *CachedDisk::map(uint64_t, size_t) {
+    // the writes made later go into the cache, not into the disk's memory,
+    // so a pointer into it would go out of date - the data is read instead
+    return nullptr;
+}
+
+void CachedDisk::sendTo(int fd, uint64_t addr, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    writeBack(addr, size);
+    lock.unlock();
+    disk->sendTo(fd, addr, size);
+}
+
+void CachedDisk::copy(uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    // the parts of the destination sharing a page with other data go through the cache
+    uint64_t start = std::min<uint64_t>(alignUp(desAddr), desAddr + size);
+    uint64_t end = std::max<uint64_t>(alignDown(desAddr + size), start);
+    std::vector<char> edge;
+    for (auto [from, to] : {std::pair(desAddr, start), std::pair(end, desAddr + size)}) {
+        if (from == to)
+            continue;
+        edge.resize(to - from);
+        transfer({{srcAddr + (from - desAddr), edge.data(), edge.size()}}, false);
+        transfer({{from, edge.data(), edge.size()}}, true);
+    }
+    if (start == end)
+        return;
+
+    // the disk must be up to date and the cached copies
+    // of the destination would be stale afterwards
+    std::unique_lock<std::mutex> lock(mutex);
+    writeBack(srcAddr + (start - desAddr), end - start);
+    dropPages(start, end - start);
+    lock.unlock();
+    disk->copy(start, srcAddr + (start - desAddr), end - start);
+}
+
+inline uint64_t CachedDisk::alignUp(uint64_t addr) {
+    return (addr + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+}
+
+inline uint64_t CachedDisk::alignDown(uint64_t addr) {
+    return addr / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+}
+
+inline char *CachedDisk::getSlotData(size_t slot) {
+    return pool + slot * CACHE_PAGE_SIZE;
+}
+
+inline uint32_t CachedDisk::getPageBytes(uint64_t index) const {
+    // the very last page may be cut off by the end of the disk
+    uint64_t start = index * CACHE_PAGE_SIZE;
+    return std::min<uint64_t>(CACHE_PAGE_SIZE, diskSize - start);
+}
+
+size_t CachedDisk::getFreeSlot() {
+    // CLOCK - every page gets a second chance before it's evicted
+    for (size_t i = 0; i <= 2 * pages.size(); i++) {
+        size_t slot = clockHand;
+        clockHand = (clockHand + 1) % pages.size();
+
+        Page_t &page = pages[slot];
+        if (page.valid == false)
+            return slot;
+        if (page.pinned)
+            continue;
+        if (page.referenced) {
+            page.referenced = false;
+            continue;
+        }
+        if (page.dirty)
+            disk->writeAt(page.index * CACHE_PAGE_SIZE, getSlotData(slot), getPageBytes(page.index));
+        lookup.erase(page.index);
+        page.valid = false;
+        return slot;
+    }
+    assert(false && "all pages are pinned");
+    return 0;
+}
+
+void CachedDisk::pinPages(const std::map<uint64_t, bool> &needed) {
+    std::vector<IOVec_t> loads;
+
+    for (auto &[index, load] : needed) {
+        auto it = lookup.find(index);
+        if (it != lookup.end()) {
+            pages[it->second].pinned = true;
+            pages[it->second].referenced = true;
+            continue;
+        }
+        size_t slot = getFreeSlot();
+        pages[slot] = {index, true, false, true, true};
+        lookup[index] = slot;
+
+        // pages that are going to be overwritten as a whole are not read
+        if (load)
+            loads.push_back({index * CACHE_PAGE_SIZE, getSlotData(slot), getPageBytes(index)});
+    }
+
+    // all missing pages are read in one batch (in ascending order,
+    // so the driver can merge neighboring pages)
+    if (!loads.empty())
+        disk->readv(loads);
+}
+
+void CachedDisk::unpinPages(const std::map<uint64_t, bool> &needed) {
+    for (auto &[index, load] : needed)
+        pages[lookup.at(index)].pinned = false;
+}
+
+void CachedDisk::copyPages(const IOVec_t &request, bool write) {
+    uint64_t addr = request.addr;
+    size_t done = 0;
+
+    while (done < request.size) {
+        uint64_t index = addr / CACHE_PAGE_SIZE;
+        uint32_t offset = addr % CACHE_PAGE_SIZE;
+        size_t bytes = std::min<size_t>(request.size - done, CACHE_PAGE_SIZE - offset);
+        size_t slot = lookup.at(index);
+        char *data = getSlotData(slot) + offset;
+
+        if (write) {
+            memcpy(data, request.buffer + done, bytes);
+            pages[slot].dirty = true;
+        } else {
+            memcpy(request.buffer + done, data, bytes);
+        }
+        addr += bytes;
+        done += bytes;
+    }
+}
+
+void CachedDisk::processGroup(const std::vector<IOVec_t> &group, std::map<uint64_t, bool> &needed, bool write) {
+    pinPages(needed);
+    for (auto &request : group)
+        copyPages(request, write);
+    unpinPages(needed);
+    needed.clear();
+}
+
+void CachedDisk::writeBack(uint64_t addr, size_t size) {
+    std::vector<size_t> slots;
+    uint64_t end = addr + size;
+
+    for (size_t slot = 0; slot < pages.size(); slot++) {
+        uint64_t start = pages[slot].index * CACHE_PAGE_SIZE;
+        if (pages[slot].valid && pages[slot].dirty && start < end && start + CACHE_PAGE_SIZE > addr)
+            slots.push_back(slot);
+    }
+    if (slots.empty())
+        return;
+
+    // sort the pages so the driver can merge them into large writes
+    std::sort(slots.begin(), slots.end(), [this](size_t a, size_t b) {
+        return pages[a].index < pages[b].index;
+    });
+
+    std::vector<IOVec_t> writes;
+    for (auto slot : slots) {
+        writes.push_back({pages[slot].index * CACHE_PAGE_SIZE, getSlotData(slot), getPageBytes(pages[slot].index)});
+        pages[slot].dirty = false;
+    }
+    disk->writev(writes);
+}
+
+void CachedDisk::updateCachedPages(const IOVec_t &request) {
+    uint64_t end = request.addr + request.size;
+
+    // keep the cached copies in sync with what goes straight to the disk
+    for (size_t slot = 0; slot < pages.size(); slot++) {
+        if (pages[slot].valid == false)
+            continue;
+        uint64_t start = pages[slot].index * CACHE_PAGE_SIZE;
+        uint64_t from = std::max<uint64_t>(start, request.addr);
+        uint64_t to = std::min<uint64_t>(start + CACHE_PAGE_SIZE, end);
+        if (from < to)
+            memcpy(getSlotData(slot) + (from - start), request.buffer + (from - request.addr), to - from);
+    }
+}
+
+void CachedDisk::dropPages() {
+    for (auto &page : pages)
+        page.valid = page.dirty = page.referenced = page.pinned = false;
+    lookup.clear();
+    clockHand = 0;
+}
+
+void CachedDisk::dropPages(uint64_t addr, size_t size) {
+    uint64_t end = addr + size;
+    for (auto &page : pages) {
+        uint64_t start = page.index * CACHE_PAGE_SIZE;
+        if (page.valid && start < end && start + CACHE_PAGE_SIZE > addr) {
+            lookup.erase(page.index);
+            page.valid = page.dirty = page.referenced = false;
+        }
+    }
+}
+
+void CachedDisk::transfer(const std::vector<IOVec_t> &requests, bool write) {
+    std::vector<IOVec_t> direct;
+    std::vector<IOVec_t> cached;
+    std::vector<IOVec_t> group;
+    std::map<uint64_t, bool> needed; // page number -> must be read first
+
+    for (auto &request : requests) {
+        if (request.size == 0)
+            continue;
+        if (request.size < BYPASS_SIZE) {
+            cached.push_back(request);
+            continue;
+        }
+
+        // the ends of a large write sharing a page with other data go through the cache,
+        // otherwise the page could be read into the cache before the write gets there
+        uint64_t start = request.addr;
+        uint64_t end = request.addr + request.size;
+        if (write) {
+            start = alignUp(start);
+            end = alignDown(end);
+            if (start > request.addr)
+                cached.push_back({request.addr, request.buffer, start - request.addr});
+            if (end < request.addr + request.size)
+                cached.push_back({end, request.buffer + (end - request.addr), request.addr + request.size - end});
+        }
+        direct.push_back({start, request.buffer + (start - request.addr), end - start});
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto &request : cached) {
+        uint64_t firstPage = request.addr / CACHE_PAGE_SIZE;
+        uint64_t lastPage = (request.addr + request.size - 1) / CACHE_PAGE_SIZE;
+
+        // don't pin more than a half of the cache at once
+        if (!group.empty() && needed.size() + (lastPage - firstPage + 1) > pages.size() / 2) {
+            processGroup(group, needed, write);
+            group.clear();
+        }
+        for (uint64_t index = firstPage; index <= lastPage; index++) {
+            uint64_t start = index * CACHE_PAGE_SIZE;
+            bool covered = write && request.addr <= start && request.addr + request.size >= start + getPageBytes(index);
+            needed[index] = needed[index] || !covered;
+        }
+        group.push_back(request);
+    }
+    if (!group.empty())
+        processGroup(group, needed, write);
+
+    if (direct.empty())
+        return;
+    if (write) {
+        for (auto &request : direct)
+            updateCachedPages(request);
+        lock.unlock();
+        disk->writev(direct);
+    } else {
+        for (auto &request : direct)
+            writeBack(request.addr, request.size);
+        lock.unlock();
+        disk->readv(direct);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _CACHED_DISK_H_
+#define _CACHED_DISK_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+#include "diskdriver.h"
+
+// a page cache with write-back that can be put in front of any disk driver
+class CachedDisk : public IDiskDriver {
+public:
+    static constexpr uint32_t CACHE_PAGE_SIZE = 4096;
+    static constexpr uint32_t DEFAULT_PAGE_COUNT = 1024;
+
+    // large transfers go straight to the disk so they don't flush the cache
+    static constexpr uint32_t BYPASS_SIZE = 16 * CACHE_PAGE_SIZE;
+
+private:
+    struct Page_t {
+        uint64_t index; // page number on the disk
+        bool valid;
+        bool dirty;
+        bool referenced;
+        bool pinned;
+    };
+
+    IDiskDriver *disk;
+    char *pool;
+    std::vector<Page_t> pages;
+    std::unordered_map<uint64_t, size_t> lookup; // page number -> slot in the pool
+    size_t clockHand;
+    uint64_t diskSize;
+    uint64_t addr;
+
+    // guards the cache, transfers that bypass it run outside of it
+    std::mutex mutex;
+
+    static inline uint64_t alignUp(uint64_t addr);
+    static inline uint64_t alignDown(uint64_t addr);
+    inline char *getSlotData(size_t slot);
+    inline uint32_t getPageBytes(uint64_t index) const;
+    size_t getFreeSlot();
+    void pinPages(const std::map<uint64_t, bool> &needed);
+    void unpinPages(const std::map<uint64_t, bool> &needed);
+    void copyPages(const IOVec_t &request, bool write);
+    void processGroup(const std::vector<IOVec_t> &group, std::map<uint64_t, bool> &needed, bool write);
+    void writeBack(uint64_t addr, size_t size);
+    void updateCachedPages(const IOVec_t &request);
+    void dropPages();
+    void dropPages(uint64_t addr, size_t size);
+    void transfer(const std::vector<IOVec_t> &requests, bool write);
+
+public:
+    CachedDisk(IDiskDriver *disk, uint32_t pageCount = DEFAULT_PAGE_COUNT);
+    ~CachedDisk();
+
+    bool diskExists(std::string name) override;
+    void open(std::string name) override;
+    void close() override;
+    void create(std::string name, uint64_t size) override;
+    void setAddr(uint64_t addr) override;
+    void write(const char *data, size_t size) override;
+    void read(char *buffer, size_t size) override;
+    uint64_t getSize() override;
+    void sync() override;
+    void readAt(uint64_t addr, char *buffer, size_t size) override;
+    void writeAt(uint64_t addr, const char *data, size_t size) override;
+    void readv(const std::vector<IOVec_t> &requests) override;
+    void writev(const std::vector<IOVec_t> &requests) override;
+    const char *map(uint64_t addr, size_t size) override;
+    void sendTo(int fd, uint64_t addr, size_t size) override;
+    void copy(uint64_t desAddr, uint64_t srcAddr, size_t size) override;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include <cassert>
 
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 
@@ -31,15 +32,17 @@ void Disk::close() {
     }
 }
 
-void Disk::setAddr(uint32_t addr) {
+void Disk::setAddr(uint64_t addr) {
     assert(file != NULL && "disk is null");
-    fseek(file, addr, SEEK_SET);
+    fseeko(file, addr, SEEK_SET);
 }
 
-void Disk::create(std::string name, uint32_t size) {
+void Disk::create(std::string name, uint64_t size) {
     file = fopen(name.c_str(), "wb");
     assert(file != NULL && "disk is NULL");
-    assert(ftruncate(fileno(file), size) == 0 && "creating disk failed");
+    int result = ftruncate(fileno(file), size);
+    assert(result == 0 && "creating disk failed");
+    (void)result;
     rewind(file);
     fclose(file);
 }
@@ -52,4 +55,67 @@ void Disk::write(const char *data, size_t size) {
 void Disk::read(char *buffer, size_t size) {
     assert(file != NULL && "disk is NULL");
     (void)fread(buffer, size, 1, file);
+}
+
+void Disk::readAt(uint64_t addr, char *buffer, size_t size) {
+    transfer({{addr, buffer, size}}, false);
+}
+
+void Disk::writeAt(uint64_t addr, const char *data, size_t size) {
+    transfer({{addr, const_cast<char *>(data), size}}, true);
+}
+
+void Disk::readv(const std::vector<IOVec_t> &requests) {
+    transfer(requests, false);
+}
+
+void Disk::writev(const std::vector<IOVec_t> &requests) {
+    transfer(requests, true);
+}
+
+void Disk::transfer(const std::vector<IOVec_t> &requests, bool write) {
+    assert(file != NULL && "disk is NULL");
+
+    // positional I/O bypasses the stream, so it must not hold any pending data
+    fflush(file);
+
+    // merge requests that follow each other on the disk into one call
+    for (size_t i = 0; i < requests.size();) {
+        size_t count = countAdjacent(requests, i);
+        transferRun(fileno(file), requests.data() + i, count, write);
+        i += count;
+    }
+}
+
+uint64_t Disk::getSize() {
+    assert(file != NULL && "disk is NULL");
+    struct stat info;
+    int result = fstat(fileno(file), &info);
+    assert(result == 0 && "could not get the size of the disk");
+    (void)result;
+    return info.st_size;
+}
+
+void Disk::sync() {
+    assert(file != NULL && "disk is NULL");
+    fflush(file);
+
+    // flushing only hands the data over to the system, it has to reach the disk itself
+    int result = fdatasync(fileno(file));
+    assert(result == 0 && "could not sync the disk");
+    (void)result;
+}
+
+void Disk::sendTo(int fd, uint64_t addr, size_t size) {
+    assert(file != NULL && "disk is NULL");
+    fflush(file);
+    if (sendFile(fileno(file), fd, addr, size) == false)
+        IDiskDriver::sendTo(fd, addr, size);
+}
+
+void Disk::copy(uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    assert(file != NULL && "disk is NULL");
+    fflush(file);
+    if (copyFile(fileno(file), desAddr, srcAddr, size) == false)
+        IDiskDriver::copy(desAddr, srcAddr, size);
 }
\ No newline at end of file
@@ -11,6 +11,8 @@ class Disk : public IDiskDriver {
 private:
     FILE *file;
 
+    void transfer(const std::vector<IOVec_t> &requests, bool write);
+
 public:
     Disk();
     ~Disk();
@@ -18,10 +20,18 @@ public:
     bool diskExists(std::string name) override;
     void open(std::string name) override;
     void close() override;
-    void create(std::string name, uint32_t size) override;
-    void setAddr(uint32_t addr) override;
+    void create(std::string name, uint64_t size) override;
+    void setAddr(uint64_t addr) override;
     void write(const char *data, size_t size) override;
     void read(char *buffer, size_t size) override;
+    uint64_t getSize() override;
+    void sync() override;
+    void readAt(uint64_t addr, char *buffer, size_t size) override;
+    void writeAt(uint64_t addr, const char *data, size_t size) override;
+    void readv(const std::vector<IOVec_t> &requests) override;
+    void writev(const std::vector<IOVec_t> &requests) override;
+    void sendTo(int fd, uint64_t addr, size_t size) override;
+    void copy(uint64_t desAddr, uint64_t srcAddr, size_t size) override;
 };
 
 #endif
\ No newline at end of file
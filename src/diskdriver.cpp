@@ -1,5 +1,171 @@
+#include <cerrno>
+#include <cassert>
+#include <climits>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
 #include "diskdriver.h"
 
 IDiskDriver::~IDiskDriver() {
     
+}
+
+void IDiskDriver::sync() {
+}
+
+const char *IDiskDriver::map(uint64_t, size_t) {
+    return nullptr;
+}
+
+void IDiskDriver::readAt(uint64_t addr, char *buffer, size_t size) {
+    setAddr(addr);
+    read(buffer, size);
+}
+
+void IDiskDriver::writeAt(uint64_t addr, const char *data, size_t size) {
+    setAddr(addr);
+    write(data, size);
+}
+
+void IDiskDriver::readv(const std::vector<IOVec_t> &requests) {
+    for (auto &request : requests)
+        readAt(request.addr, request.buffer, request.size);
+}
+
+void IDiskDriver::writev(const std::vector<IOVec_t> &requests) {
+    for (auto &request : requests)
+        writeAt(request.addr, request.buffer, request.size);
+}
+
+void IDiskDriver::sendTo(int fd, uint64_t addr, size_t size) {
+    // write straight from the disk's memory if possible
+    const char *data = map(addr, size);
+    if (data != nullptr) {
+        writeAll(fd, data, size);
+        return;
+    }
+
+    std::vector<char> buffer(std::min(size, SEND_CHUNK_SIZE));
+    for (size_t done = 0; done < size; done += buffer.size()) {
+        buffer.resize(std::min(size - done, SEND_CHUNK_SIZE));
+        readAt(addr + done, buffer.data(), buffer.size());
+        writeAll(fd, buffer.data(), buffer.size());
+    }
+}
+
+void IDiskDriver::copy(uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    const char *data = map(srcAddr, size);
+    if (data != nullptr) {
+        writeAt(desAddr, data, size);
+        return;
+    }
+
+    std::vector<char> buffer(std::min(size, SEND_CHUNK_SIZE));
+    for (size_t done = 0; done < size; done += buffer.size()) {
+        buffer.resize(std::min(size - done, SEND_CHUNK_SIZE));
+        readAt(srcAddr + done, buffer.data(), buffer.size());
+        writeAt(desAddr + done, buffer.data(), buffer.size());
+    }
+}
+
+size_t IDiskDriver::countAdjacent(const std::vector<IOVec_t> &requests, size_t first) {
+    uint64_t end = requests[first].addr + requests[first].size;
+    size_t count = 1;
+    while (first + count < requests.size() && count < IOV_MAX && requests[first + count].addr == end) {
+        end += requests[first + count].size;
+        count++;
+    }
+    return count;
+}
+
+void IDiskDriver::transferRun(int fd, const IOVec_t *requests, size_t count, bool write) {
+    std::vector<struct iovec> iov;
+    uint64_t addr = requests[0].addr;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        iov.push_back({requests[i].buffer, requests[i].size});
+        total += requests[i].size;
+    }
+
+    // a single call transfers at most MAX_TRANSFER_SIZE bytes - the rest is picked up by the next one
+    size_t first = 0;
+    while (total > 0) {
+        ssize_t done = write ? pwritev(fd, iov.data() + first, iov.size() - first, addr)
+                             : preadv(fd, iov.data() + first, iov.size() - first, addr);
+        assert(done > 0 && "disk I/O failed");
+        addr += done;
+        total -= done;
+        skipTransferred(iov, first, done);
+    }
+}
+
+void IDiskDriver::skipTransferred(std::vector<struct iovec> &iov, size_t &first, size_t done) {
+    while (first < iov.size() && done >= iov[first].iov_len) {
+        done -= iov[first].iov_len;
+        first++;
+    }
+    if (done > 0) {
+        iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + done;
+        iov[first].iov_len -= done;
+    }
+}
+
+bool IDiskDriver::copyFile(int diskFd, uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    loff_t srcOffset = srcAddr;
+    loff_t desOffset = desAddr;
+    size_t done = 0;
+
+    // the data does not leave the kernel at all
+    while (done < size) {
+        ssize_t bytes = copy_file_range(diskFd, &srcOffset, diskFd, &desOffset, size - done, 0);
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+    if (done == size)
+        return true;
+
+    assert(done == 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP) && "copying data failed");
+    return false;
+}
+
+bool IDiskDriver::sendFile(int diskFd, int fd, uint64_t addr, size_t size) {
+    loff_t offset = addr;
+    size_t done = 0;
+
+    // copy_file_range keeps the data in the kernel (and can even share
+    // it on some file systems), but it only works between regular files
+    while (done < size) {
+        ssize_t bytes = copy_file_range(diskFd, &offset, fd, nullptr, size - done, 0);
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+
+    // sendfile works for any kind of output (pipes, terminals, ...)
+    off_t sendOffset = addr + done;
+    while (done < size) {
+        ssize_t bytes = sendfile(fd, diskFd, &sendOffset, size - done);
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+    if (done == size)
+        return true;
+
+    // neither of them is supported - the rest must go through user space
+    assert(done == 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP) && "sending data failed");
+    return false;
+}
+
+void IDiskDriver::writeAll(int fd, const char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes = ::write(fd, data + done, size - done);
+        assert(bytes > 0 && "writing to the output failed");
+        done += bytes;
+    }
 }
\ No newline at end of file
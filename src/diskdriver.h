@@ -2,19 +2,71 @@
 #define _DISK_DRIVER_H_
 
 #include <string>
+#include <vector>
 #include <cstdint>
 
+#include <sys/uio.h>
+
 class IDiskDriver {
+public:
+    // one piece of a batched (scatter/gather) request
+    struct IOVec_t {
+        uint64_t addr;
+        char *buffer;
+        size_t size;
+    };
+
 public:
     virtual ~IDiskDriver() = 0;
 
     virtual bool diskExists(std::string name) = 0;
     virtual void open(std::string name) = 0;
     virtual void close() = 0;
-    virtual void create(std::string name, uint32_t size) = 0;
-    virtual void setAddr(uint32_t addr) = 0;
+    virtual void create(std::string name, uint64_t size) = 0;
+    virtual void setAddr(uint64_t addr) = 0;
     virtual void write(const char *data, size_t size) = 0;
     virtual void read(char *buffer, size_t size) = 0;
+    virtual uint64_t getSize() = 0;
+
+    // makes sure all written data has been passed on to the disk
+    virtual void sync();
+
+    // positional operations - they do not depend on setAddr() and (as well as the
+    // batched ones, sendTo() and copy()) may be called from several threads at once
+    virtual void readAt(uint64_t addr, char *buffer, size_t size);
+    virtual void writeAt(uint64_t addr, const char *data, size_t size);
+
+    // batched operations - the whole list is submitted at once
+    virtual void readv(const std::vector<IOVec_t> &requests);
+    virtual void writev(const std::vector<IOVec_t> &requests);
+
+    // returns a pointer straight into the disk's memory so the data
+    // can be read without copying it, or nullptr if not supported
+    virtual const char *map(uint64_t addr, size_t size);
+
+    // writes a part of the disk into a file descriptor
+    virtual void sendTo(int fd, uint64_t addr, size_t size);
+
+    // copies data from one place on the disk to another (the two must not overlap)
+    virtual void copy(uint64_t desAddr, uint64_t srcAddr, size_t size);
+
+protected:
+    static constexpr size_t SEND_CHUNK_SIZE = 1 << 20;
+
+    // the most a single read/write system call transfers on Linux
+    static constexpr size_t MAX_TRANSFER_SIZE = 0x7ffff000;
+
+    // the number of requests starting with the given one that follow each other on the disk
+    // (at most IOV_MAX of them) and a transfer of such a run with as few system calls as possible
+    static size_t countAdjacent(const std::vector<IOVec_t> &requests, size_t first);
+    static void transferRun(int fd, const IOVec_t *requests, size_t count, bool write);
+
+    // moves a run past the bytes a vectored transfer has done (first is its first unfinished iovec)
+    static void skipTransferred(std::vector<struct iovec> &iov, size_t &first, size_t done);
+
+    static bool sendFile(int diskFd, int fd, uint64_t addr, size_t size);
+    static bool copyFile(int diskFd, uint64_t desAddr, uint64_t srcAddr, size_t size);
+    static void writeAll(int fd, const char *data, size_t size);
 };
 
 #endif
\ No newline at end of file
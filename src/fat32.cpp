@@ -1,310 +1,1112 @@
+#include <bit>
 #include <cmath>
 #include <memory>
+#include <latch>
+#include <queue>
+#include <semaphore>
+#include <filesystem>
+#include <algorithm>
+#include <unordered_set>
 #include <sstream>
 #include <iomanip>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+
 #include "fat32.h"
-#include "disk.h"
+#include "threadpool.h"
+#include "threadslot.h"
 
 #include "debugger.h"
 
 static std::vector<std::string> split(const std::string& s, char c);
+static void lockBoth(std::unique_lock<std::shared_mutex> &first, std::unique_lock<std::shared_mutex> &second);
+static ThreadPool &getTransferPool();
+static void runParallel(size_t count, const std::function<void(size_t)> &task);
+static void reportPathNotFound();
+static FAT32::DirEntry_t parentOf(const FAT32::DirEntry_t &entry);
+static void reportNotEnoughSpace();
+static void reportSkipped(const std::string &path, const char *reason);
+
+FAT32 *FAT32::mount(const std::string &path, IDiskDriver *disk, const Geometry_t &geometry, uint32_t tableCachePages, bool specialized) {
+    // the geometry is used only when a new disk is created,
+    // otherwise it's read from the disk's superblock
+    Geometry_t diskGeometry = geometry;
+    if (disk->diskExists(path)) {
+        disk->open(path);
+        readSuperblock(disk, diskGeometry);
+        disk->close();
+    }
 
-FAT32 *FAT32::instance = nullptr;
+    // the engines compiled for the common geometries (see the end of the file)
+    if (specialized && diskGeometry.maxNameLen == DEFAULT_MAX_NAME_LEN) {
+        switch (diskGeometry.clusterSize) {
+            case DEFAULT_CLUSTER_SIZE:
+                return new FAT32Engine<DEFAULT_CLUSTER_SIZE, DEFAULT_MAX_NAME_LEN>(path, disk, diskGeometry, tableCachePages);
+            case 512:
+                return new FAT32Engine<512, DEFAULT_MAX_NAME_LEN>(path, disk, diskGeometry, tableCachePages);
+            case KB(4):
+                return new FAT32Engine<KB(4), DEFAULT_MAX_NAME_LEN>(path, disk, diskGeometry, tableCachePages);
+            case KB(64):
+                return new FAT32Engine<KB(64), DEFAULT_MAX_NAME_LEN>(path, disk, diskGeometry, tableCachePages);
+        }
+    }
+    return new FAT32Engine<0, 0>(path, disk, diskGeometry, tableCachePages);
+}
 
-FAT32 *FAT32::getInstance() {
-    if (instance == nullptr)
-        instance = new FAT32;
-    return instance;
+uint64_t FAT32::countClusters(const Geometry_t &geometry) {
+    // each cluster takes up its own space plus its entries in the FAT and the share table
+    return (geometry.diskSize - SUPERBLOCK_SIZE) / (ADDR_SIZE + SHARE_COUNT_SIZE + geometry.clusterSize);
 }
 
-FAT32::FAT32() : disk(new Disk), workingDirStartCluster(ROOT_DIR_CLUSTER_INDEX) {
-    if (disk->diskExists(DISK_FILE_NAME) == false)
-        initialize();
-    disk->open(DISK_FILE_NAME);
-    load();
+bool FAT32::isValidGeometry(const Geometry_t &geometry) {
+    uint32_t recordFieldsSize = std::max(DIR_ENTRY_FIELDS_SIZE, DIR_HEADER_FIELDS_SIZE);
+    return geometry.maxNameLen > 0 && geometry.maxNameLen <= MAX_NAME_LEN_LIMIT &&
+           std::has_single_bit(geometry.clusterSize) && geometry.clusterSize >= geometry.maxNameLen + recordFieldsSize &&
+           geometry.diskSize > SUPERBLOCK_SIZE + ADDR_SIZE + SHARE_COUNT_SIZE + geometry.clusterSize &&
+           countClusters(geometry) < ALL_CLUSTERS_TAKEN;
+}
+
+uint64_t FAT32::countLegacyClusters(const Geometry_t &geometry) {
+    // before the share table, each cluster took up only its own space and its FAT entry
+    return geometry.diskSize / (ADDR_SIZE + geometry.clusterSize);
+}
+
+bool FAT32::isRootDirAt(IDiskDriver *disk, uint64_t addr) {
+    // the name of the root dir is "/" and it is its own parent
+    char header[DEFAULT_MAX_NAME_LEN + 2 * sizeof(uint32_t)];
+    uint32_t startCluster;
+    uint32_t parentStartCluster;
+    disk->readAt(addr, header, sizeof(header));
+    memcpy(&startCluster, header + DEFAULT_MAX_NAME_LEN, sizeof(uint32_t));
+    memcpy(&parentStartCluster, header + DEFAULT_MAX_NAME_LEN + sizeof(uint32_t), sizeof(uint32_t));
+    return header[0] == '/' && header[1] == '\0' &&
+           startCluster == ROOT_DIR_CLUSTER_INDEX && parentStartCluster == ROOT_DIR_CLUSTER_INDEX;
 }
 
-FAT32::Dir_t::~Dir_t() {
-    if (entries != nullptr) {
-        delete[] entries;
-        entries = nullptr;
+uint32_t FAT32::readSuperblock(IDiskDriver *disk, Geometry_t &geometry) {
+    Superblock_t superblock;
+    uint64_t diskSize = disk->getSize();
+    assert(diskSize >= SUPERBLOCK_SIZE && "disk is too small");
+    disk->readAt(diskSize - SUPERBLOCK_SIZE, reinterpret_cast<char *>(&superblock), sizeof(Superblock_t));
+
+    // images without a superblock were all created with the default geometry, the share
+    // table moved the clusters, so their layout is told apart by where the root dir is
+    if (superblock.magic != FS_MAGIC) {
+        assert(diskSize == DEFAULT_DISK_SIZE && "unknown geometry of the disk");
+        geometry = DEFAULT_GEOMETRY;
+        uint64_t clusterCount = countClusters(geometry);
+        bool shareTable = isRootDirAt(disk, FAT_TABLE_START_ADDR + clusterCount * (ADDR_SIZE + SHARE_COUNT_SIZE));
+        bool noShareTable = isRootDirAt(disk, FAT_TABLE_START_ADDR + countLegacyClusters(geometry) * ADDR_SIZE);
+        assert(shareTable != noShareTable && "unknown layout of the disk");
+        return shareTable ? 1 : 0;
+    }
+
+    uint32_t version = superblock.version;
+    assert(version <= FS_VERSION && "unsupported version of the disk");
+    if (version == 3) {
+        // the disk size used to be a 32-bit field in front of the rest of the geometry
+        // and there was no summary (it's marked as out of date, so it gets recounted)
+        LegacySuperblock_t legacy;
+        memcpy(&legacy, &superblock, sizeof(LegacySuperblock_t));
+        superblock = {legacy.magic, legacy.version, legacy.clusterSize, legacy.maxNameLen, legacy.clusterCount, legacy.diskSize,
+                      FS_STATE_DIRTY, 0, 0, 0};
+    }
+    if (version >= 3) {
+        assert(superblock.diskSize == diskSize && "disk size does not match the superblock");
+        geometry = {superblock.diskSize, superblock.clusterSize, superblock.maxNameLen};
+        assert(superblock.clusterCount == countClusters(geometry) && "corrupted superblock");
+    } else {
+        // version 2 disks were created with the default geometry, too
+        assert(diskSize == DEFAULT_DISK_SIZE && "unknown geometry of the disk");
+        geometry = DEFAULT_GEOMETRY;
     }
+    return version;
 }
 
-bool FAT32::DirEntry_t::operator==(const DirEntry_t other) const {
-    return memcmp(reinterpret_cast<const void *>(this), reinterpret_cast<const void *>(&other), sizeof(DirEntry_t)) == 0;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::FAT32Engine(const std::string &path, IDiskDriver *disk, const Geometry_t &geometry, uint32_t tableCachePages) : disk(disk), path(path), tableCachePages(tableCachePages), dirCache(DIR_CACHE_SIZE), transactionOpen(false), sessionCount(0) {
+    if (disk->diskExists(path) == false)
+        initialize(geometry);
+    disk->open(path);
+    load();
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::~FAT32Engine() {
+    // the transaction left open (e.g. the shell exits after begin) is committed
+    // the same way as if it was done explicitly, the tables stop holding pages too
+    if (transactionOpen)
+        commit();
+    sync();
+    disk->close();
+    delete disk;
 }
 
-bool FAT32::DirEntry_t::operator!=(const DirEntry_t other) const {
+bool FAT32::DirEntry_t::operator==(const DirEntry_t &other) const {
+    return name == other.name && startCluster == other.startCluster && parentStartCluster == other.parentStartCluster &&
+           size == other.size && directory == other.directory;
+}
+
+bool FAT32::DirEntry_t::operator!=(const DirEntry_t &other) const {
     return !(*this == other);
 }
 
-void FAT32::initialize() {
-    disk->create(DISK_FILE_NAME, DISK_SIZE);
-    disk->open(DISK_FILE_NAME);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::setGeometry(const Geometry_t &geometry) {
+    assert(isValidGeometry(geometry) && "invalid geometry");
+    assert((CLUSTER_SIZE == 0 || CLUSTER_SIZE == geometry.clusterSize) && "cluster size does not match the engine");
+    assert((MAX_NAME_LEN == 0 || MAX_NAME_LEN == geometry.maxNameLen) && "max name length does not match the engine");
+    this->geometry = geometry;
+
+    clusterCount = countClusters(geometry);
+    shareTableStartAddr = FAT_TABLE_START_ADDR + static_cast<uint64_t>(clusterCount) * ADDR_SIZE;
+    clustersStartAddr = shareTableStartAddr + static_cast<uint64_t>(clusterCount) * SHARE_COUNT_SIZE;
+    superblockAddr = geometry.diskSize - SUPERBLOCK_SIZE;
+
+    fat.init(disk, FAT_TABLE_START_ADDR, clusterCount, tableCachePages);
+    shares.init(disk, shareTableStartAddr, clusterCount, tableCachePages);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::initialize(const Geometry_t &geometry) {
+    setGeometry(geometry);
+    disk->create(path, geometry.diskSize);
+    disk->open(path);
     fat.fill(FREE_CLUSTER);
+    shares.fill(0);
+    resetFreeMap();
+    freeClusters = clusterCount;
+    sharedClusters = 0;
+    summaryDirty = true;
     std::unique_ptr<Dir_t> rootDir(createEmptyDir("/", ROOT_DIR_CLUSTER_INDEX));
-    saveDir(rootDir.get());
+    assert(rootDir != nullptr && "not enough free clusters");
+    saveDirHeader(rootDir.get());
+    releaseReservations();
     saveFat();
+    summaryDirty = false;
+    saveSuperblock(FS_STATE_CLEAN);
     disk->close();
 }
 
-inline void FAT32::saveFat() {
-    disk->setAddr(FAT_TABLE_START_ADDR);
-    disk->write(reinterpret_cast<const char *>(&fat), sizeof(fat));
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveSuperblock(uint32_t state) {
+    std::unique_lock<std::mutex> lock(allocMutex);
+
+    // skip the words of the free map that have been filled up since
+    // (a clean summary is saved only once all reservations are released)
+    while (freeHint < freeMap.size() && freeMap[freeHint] == 0)
+        freeHint++;
+    // (the free map runs past the end of the FAT when the disk is full)
+    uint32_t nextFreeCluster = std::min<uint64_t>(static_cast<uint64_t>(freeHint) * 64, clusterCount);
+    lock.unlock();
+
+    Superblock_t superblock = {FS_MAGIC, FS_VERSION, getClusterSize(), getMaxNameLen(), clusterCount, geometry.diskSize,
+                               state, freeClusters, sharedClusters, nextFreeCluster};
+    disk->writeAt(superblockAddr, reinterpret_cast<const char *>(&superblock), sizeof(Superblock_t));
 }
 
-inline void FAT32::loadFat() {
-    disk->setAddr(FAT_TABLE_START_ADDR);
-    disk->read(reinterpret_cast<char *>(&fat), sizeof(fat));
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::loadSummary() {
+    Superblock_t superblock;
+    disk->readAt(superblockAddr, reinterpret_cast<char *>(&superblock), sizeof(Superblock_t));
+    if (superblock.state != FS_STATE_CLEAN)
+        return false;
+    assert(superblock.freeClusters <= clusterCount && superblock.nextFreeCluster <= clusterCount && "corrupted superblock");
+
+    freeClusters = superblock.freeClusters;
+    sharedClusters = superblock.sharedClusters;
+    summaryDirty = false;
+
+    // there are no free clusters before the next free one, so the pages
+    // of the FAT in front of it are known to be full without reading them
+    freeMap.assign(superblock.nextFreeCluster / FAT_PAGE_ENTRIES * (FAT_PAGE_ENTRIES / 64), 0);
+    freeHint = freeMap.size();
+    return true;
 }
 
-void FAT32::load() {
-    loadFat();
-    workingDirStartCluster = ROOT_DIR_CLUSTER_INDEX;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::recountClusters() {
+    // the disk was not shut down properly (or it's too old to have a summary)
+    // - the whole FAT and share table have to be gone through
+    resetFreeMap();
+    while (static_cast<uint64_t>(freeMap.size()) * 64 < clusterCount)
+        scanFatPage();
+    freeClusters = mappedFreeClusters;
+
+    sharedClusters = 0;
+    for (uint32_t i = 0; i < clusterCount; i++)
+        if (shares[i] > 0)
+            sharedClusters++;
+
+    // the summary on the disk is still out of date
+    summaryDirty = true;
 }
 
-void FAT32::saveDir(Dir_t *dir) {
-    assert(dir != nullptr && "dir is nullptr");
-    freeAllOccupiedClusters(dir->header.startCluster);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::markSummaryDirty() {
+    // the summary is marked as out of date before the first change after
+    // mounting or syncing the disk can reach it (it stays so until the next sync)
+    if (summaryDirty)
+        return;
+    std::lock_guard<std::mutex> lock(summaryMutex);
+    if (summaryDirty == false) {
+        // the mark must not wait in a page cache in front of the disk, where it
+        // could be overwritten by the clean one before ever reaching the disk
+        saveSuperblock(FS_STATE_DIRTY);
+        disk->sync();
+        summaryDirty = true;
+    }
+}
 
-    uint32_t entriesInFirstCluster = std::min(dir->header.entryCount, ENTRIES_IN_CLUSTER_AFTER_DIR_HEADER);
-    bool allFitsInOneCluster = dir->header.entryCount <= ENTRIES_IN_CLUSTER_AFTER_DIR_HEADER; 
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::migrateShareTable() {
+    // the clusters used to start right after the FAT, there were more of them
+    uint32_t legacyClusterCount = countLegacyClusters(geometry);
+    uint64_t legacyClustersStartAddr = FAT_TABLE_START_ADDR + static_cast<uint64_t>(legacyClusterCount) * ADDR_SIZE;
+    std::vector<uint32_t> legacyFat(legacyClusterCount);
+    disk->readAt(FAT_TABLE_START_ADDR, reinterpret_cast<char *>(legacyFat.data()), legacyFat.size() * ADDR_SIZE);
+    for (uint32_t i = clusterCount; i < legacyClusterCount; i++)
+        assert(legacyFat[i] == FREE_CLUSTER && "the disk is too full to make room for the share table");
+
+    // the clusters move towards the end of the disk, so they're
+    // copied from the last one to never overwrite one not moved yet
+    for (uint32_t i = clusterCount; i-- > 0;)
+        if (legacyFat[i] != FREE_CLUSTER)
+            disk->copy(clusterAddr(i), legacyClustersStartAddr + static_cast<uint64_t>(i) * getClusterSize(), getClusterSize());
+
+    // the share table takes the place of the end of the old FAT and the first clusters
+    disk->writeAt(FAT_TABLE_START_ADDR, reinterpret_cast<const char *>(legacyFat.data()), static_cast<uint64_t>(clusterCount) * ADDR_SIZE);
+    fat.init(disk, FAT_TABLE_START_ADDR, clusterCount, tableCachePages);
+    shares.fill(0);
+}
 
-    if (allFitsInOneCluster) {
-        // all we need is the end of file cluster (the first one is
-        // already there as we skipped it in freeAllOccupiedClusters)
-        assert(existsNumberOfFreeClusters(1) && "not enough free clusters");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::migrateEofClusters() {
+    std::vector<uint32_t> lastClusters;
+
+    // find the last cluster of every chain (the one before the extra EOF cluster)
+    for (uint32_t i = 0; i < clusterCount; i++)
+        if (fat[i] < clusterCount && fat[fat[i]] == EOF_CLUSTER)
+            lastClusters.push_back(i);
+
+    // it now ends the chain itself and the EOF cluster is released
+    for (auto cluster : lastClusters) {
+        uint32_t eofCluster = fat[cluster];
+        setShareCount(eofCluster, 0);
+        setFatEntry(eofCluster, FREE_CLUSTER);
+        setFatEntry(cluster, EOF_CLUSTER);
+    }
 
-        saveDirFirstCluster(dir, entriesInFirstCluster);
+    // the table must be on the disk before the image is marked as migrated
+    saveFat();
+}
 
-        // link up the last EOF cluster to the whole chain
-        uint32_t eofCluster = getFreeCluster();
-        fat[dir->header.startCluster] = eofCluster;
-        fat[eofCluster] = EOF_CLUSTER;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::migrateDirEntries() {
+    // the dirs hold 32-bit file sizes, so each of them is read
+    // in the old format and written out again in the new one
+    uint32_t entrySize = getMaxNameLen() + LEGACY_DIR_ENTRY_FIELDS_SIZE;
+    uint32_t entriesInFirstCluster = (getClusterSize() - getDirHeaderSize()) / entrySize;
+    uint32_t entriesInOneCluster = getClusterSize() / entrySize;
+    std::vector<uint32_t> pendingDirs = {ROOT_DIR_CLUSTER_INDEX};
+    std::vector<char> data;
+
+    while (!pendingDirs.empty()) {
+        uint32_t startCluster = pendingDirs.back();
+        pendingDirs.pop_back();
+
+        Dir_t dir;
+        data.clear();
+        for (uint32_t cluster = startCluster; cluster != EOF_CLUSTER; cluster = fat[cluster]) {
+            dir.clusters.push_back(cluster);
+            data.resize(data.size() + getClusterSize());
+            disk->readAt(clusterAddr(cluster), data.data() + data.size() - getClusterSize(), getClusterSize());
+        }
 
-        saveFat();
-        return;
+        deserializeDirHeader(dir.header, data.data());
+        dir.entries.resize(dir.header.entryCount);
+        for (uint32_t i = 0; i < dir.header.entryCount; i++) {
+            size_t offset = getDirHeaderSize() + static_cast<size_t>(i) * entrySize;
+            if (i >= entriesInFirstCluster) {
+                uint32_t j = i - entriesInFirstCluster;
+                offset = static_cast<size_t>(1 + j / entriesInOneCluster) * getClusterSize() + (j % entriesInOneCluster) * entrySize;
+            }
+            const char *entryData = data.data() + offset;
+            DirEntry_t &entry = dir.entries[i];
+            uint32_t size;
+
+            entry.name.assign(entryData, strnlen(entryData, getMaxNameLen()));
+            entryData += getMaxNameLen();
+            memcpy(&entry.startCluster, entryData, sizeof(uint32_t));
+            memcpy(&entry.parentStartCluster, entryData + 4, sizeof(uint32_t));
+            memcpy(&size, entryData + 8, sizeof(uint32_t));
+            memcpy(&entry.directory, entryData + 12, sizeof(bool));
+            entry.size = size;
+
+            if (entry.directory)
+                pendingDirs.push_back(entry.startCluster);
+        }
+        saveDir(&dir);
     }
 
-    uint32_t remainingEntries = dir->header.entryCount - entriesInFirstCluster;
-    uint32_t clustersNeeded = ceil(static_cast<double>(remainingEntries) / ENTRIES_IN_ONE_CLUSTER);
+    // the table must be on the disk before the image is marked as migrated
+    saveFat();
+}
 
-    // make sure we have enough free clusters (+1 is the final EOF cluster)
-    assert(existsNumberOfFreeClusters(1 + clustersNeeded) && "not enough free clusters");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveFat() {
+    fat.flush();
+    shares.flush();
+}
 
-    // save all entries that fit into the first cluster
-    saveDirFirstCluster(dir, entriesInFirstCluster);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::load() {
+    Geometry_t geometry;
+    uint32_t version = readSuperblock(disk, geometry);
+    setGeometry(geometry);
+    if (version < 1)
+        migrateShareTable();
+
+    // nothing is read from the FAT until it's needed unless
+    // the summary of the free clusters is not to be trusted
+    resetFreeMap();
+    if (version < 5 || loadSummary() == false)
+        recountClusters();
+
+    if (version < 2)
+        migrateEofClusters();
+    if (version < 4)
+        migrateDirEntries();
+    if (version < FS_VERSION)
+        saveSuperblock(summaryDirty ? FS_STATE_DIRTY : FS_STATE_CLEAN);
+
+    dirCache.clear();
+}
 
-    uint32_t prevCluster = dir->header.startCluster;
-    uint32_t currCluster;
-    uint32_t entryIndex = entriesInFirstCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::serializeDirEntry(const DirEntry_t &entry, char *data) const {
+    memset(data, 0, getMaxNameLen());
+    memcpy(data, entry.name.data(), std::min<size_t>(entry.name.length(), getMaxNameLen()));
+    data += getMaxNameLen();
+    memcpy(data, &entry.startCluster, sizeof(uint32_t));
+    memcpy(data + 4, &entry.parentStartCluster, sizeof(uint32_t));
+    memcpy(data + 8, &entry.size, sizeof(uint64_t));
+    memcpy(data + 16, &entry.directory, sizeof(bool));
+}
 
-    // the very last cluster has to be handeled separately due to the reamaining space 
-    for (uint32_t i = 0; i < clustersNeeded - 1; i++) {
-        // create a link in the fat table
-        currCluster = getFreeCluster();
-        fat[prevCluster] = currCluster;
-        prevCluster = currCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::deserializeDirEntry(DirEntry_t &entry, const char *data) const {
+    entry.name.assign(data, strnlen(data, getMaxNameLen()));
+    data += getMaxNameLen();
+    memcpy(&entry.startCluster, data, sizeof(uint32_t));
+    memcpy(&entry.parentStartCluster, data + 4, sizeof(uint32_t));
+    memcpy(&entry.size, data + 8, sizeof(uint64_t));
+    memcpy(&entry.directory, data + 16, sizeof(bool));
+}
 
-        // store as many entries into one cluster as possible
-        disk->setAddr(clusterAddr(currCluster));
-        disk->write(reinterpret_cast<const char *>(&dir->entries[entryIndex]), ENTRIES_IN_ONE_CLUSTER * sizeof(DirEntry_t));
-        entryIndex += ENTRIES_IN_ONE_CLUSTER;
-    }
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::serializeDirHeader(const DirHeader_t &header, char *data) const {
+    memset(data, 0, getMaxNameLen());
+    memcpy(data, header.name.data(), std::min<size_t>(header.name.length(), getMaxNameLen()));
+    data += getMaxNameLen();
+    memcpy(data, &header.startCluster, sizeof(uint32_t));
+    memcpy(data + 4, &header.parentStartCluster, sizeof(uint32_t));
+    memcpy(data + 8, &header.entryCount, sizeof(uint32_t));
+}
 
-    uint32_t offset = 0;
-    currCluster = getFreeCluster();
-    fat[prevCluster] = currCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::deserializeDirHeader(DirHeader_t &header, const char *data) const {
+    header.name.assign(data, strnlen(data, getMaxNameLen()));
+    data += getMaxNameLen();
+    memcpy(&header.startCluster, data, sizeof(uint32_t));
+    memcpy(&header.parentStartCluster, data + 4, sizeof(uint32_t));
+    memcpy(&header.entryCount, data + 8, sizeof(uint32_t));
+}
 
-    // store the very last entries
-    for (; entryIndex < dir->header.entryCount; entryIndex++) {
-        disk->setAddr(clusterAddr(currCluster) + offset);
-        disk->write(reinterpret_cast<const char *>(&dir->entries[entryIndex]), sizeof(DirEntry_t));
-        offset += sizeof(DirEntry_t);
-    }
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveDirHeader(Dir_t *dir) {
+    assert(dir != nullptr && "dir is nullptr");
+    if (deferDirWrite(dir))
+        return;
 
-    // lastely we need to link up the EOF cluster
-    prevCluster = currCluster;
-    currCluster = getFreeCluster();
-    fat[prevCluster] = currCluster;
-    fat[currCluster] = EOF_CLUSTER;
+    // the clusters the dir points to must be taken on the disk first
     saveFat();
+    std::vector<char> data(getDirHeaderSize());
+    serializeDirHeader(dir->header, data.data());
+    disk->writeAt(clusterAddr(dir->header.startCluster), data.data(), data.size());
 }
 
-void  FAT32::saveDirFirstCluster(Dir_t *dir, uint32_t entryCount) {
-    // store the directory header
-    disk->setAddr(clusterAddr(dir->header.startCluster));
-    disk->write(reinterpret_cast<const char *>(&dir->header), sizeof(DirHeader_t));
-    
-    // skip the header (offstet = sizeof(DirHeader_t))
-    // and store all entries into the first cluster
-    disk->setAddr(clusterAddr(dir->header.startCluster) + sizeof(DirHeader_t));
-    disk->write(reinterpret_cast<const char *>(dir->entries), entryCount * sizeof(DirEntry_t));
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveDirEntry(Dir_t *dir, uint32_t index) {
+    assert(dir != nullptr && "dir is nullptr");
+    assert(index < dir->header.entryCount && "entry index out of range");
+    if (deferDirWrite(dir))
+        return;
+    saveFat();
+    std::vector<char> data(getDirEntrySize());
+    serializeDirEntry(dir->entries[index], data.data());
+    disk->writeAt(getDirEntryAddr(dir, index), data.data(), data.size());
 }
 
-inline uint32_t FAT32::clusterAddr(uint32_t index) {
-    return CLUSTERS_START_ADDR + (index * CLUSTER_SIZE);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveDir(Dir_t *dir) {
+    assert(dir != nullptr && "dir is nullptr");
+    uint32_t entryCount = dir->header.entryCount;
+    uint32_t clustersNeeded = getDirClustersNeeded(entryCount);
+
+    // the chain grows before the dir is written and shrinks after it,
+    // so the dir on the disk never points to a cluster marked as free
+    std::vector<uint32_t> &clusters = dir->clusters;
+    assert(!clusters.empty() && clusters[0] == dir->header.startCluster && "dir's chain is not known");
+    while (clusters.size() < clustersNeeded) {
+        uint32_t newCluster = getFreeCluster();
+        assert(newCluster != ALL_CLUSTERS_TAKEN && "not enough free clusters");
+        setFatEntry(clusters.back(), newCluster);
+        setFatEntry(newCluster, EOF_CLUSTER);
+        clusters.push_back(newCluster);
+    }
+    saveFat();
+
+    // the header and all the entries are laid out the same way getDirEntryAddr() expects
+    std::vector<char> data(static_cast<size_t>(clustersNeeded) * getClusterSize(), 0);
+    serializeDirHeader(dir->header, data.data());
+    for (uint32_t i = 0; i < entryCount; i++) {
+        size_t offset = getDirHeaderSize() + static_cast<size_t>(i) * getDirEntrySize();
+        if (i >= getEntriesInClusterAfterDirHeader()) {
+            uint32_t j = i - getEntriesInClusterAfterDirHeader();
+            offset = static_cast<size_t>(1 + j / getEntriesInOneCluster()) * getClusterSize() + (j % getEntriesInOneCluster()) * getDirEntrySize();
+        }
+        serializeDirEntry(dir->entries[i], data.data() + offset);
+    }
+
+    std::vector<IDiskDriver::IOVec_t> requests;
+    for (uint32_t i = 0; i < clustersNeeded; i++)
+        requests.push_back({clusterAddr(clusters[i]), data.data() + static_cast<size_t>(i) * getClusterSize(), getClusterSize()});
+    disk->writev(requests);
+
+    if (clusters.size() > clustersNeeded) {
+        freeAllOccupiedClusters(clusters[clustersNeeded - 1]);
+        setFatEntry(clusters[clustersNeeded - 1], EOF_CLUSTER);
+        clusters.resize(clustersNeeded);
+    }
 }
 
-FAT32::Dir_t *FAT32::loadDir(uint32_t startCluster) {
-    Dir_t *dir = new Dir_t;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getDirEntryAddr(Dir_t *dir, uint32_t index) {
+    // the first cluster starts with the dir's header
+    if (index < getEntriesInClusterAfterDirHeader())
+        return clusterAddr(dir->header.startCluster) + getDirHeaderSize() + index * getDirEntrySize();
 
-    // read the dir's header - contains basic info
-    disk->setAddr(clusterAddr(startCluster));
-    disk->read(reinterpret_cast<char *>(&dir->header), sizeof(DirHeader_t));
+    index -= getEntriesInClusterAfterDirHeader();
+    uint32_t cluster = dir->clusters[1 + index / getEntriesInOneCluster()];
+    return clusterAddr(cluster) + (index % getEntriesInOneCluster()) * getDirEntrySize();
+}
 
-    uint32_t entriesInFirstCluster = std::min(dir->header.entryCount, ENTRIES_IN_CLUSTER_AFTER_DIR_HEADER);
-    dir->entries = new DirEntry_t[dir->header.entryCount];
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::clusterAddr(uint32_t index) {
+    return clustersStartAddr + static_cast<uint64_t>(index) * getClusterSize();
+}
 
-    // set the address to the very first entry (skip the header)
-    disk->setAddr(clusterAddr(startCluster) + sizeof(DirHeader_t));
-    disk->read(reinterpret_cast<char *>(dir->entries), entriesInFirstCluster * sizeof(DirEntry_t));
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::shared_ptr<FAT32::Dir_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::loadDir(uint32_t startCluster) {
+    // the caller holds the dir's lock so nobody changes it meanwhile
+    // (and it has made sure the dir has not been removed, see loadLiveDir())
+    {
+        std::lock_guard<std::mutex> lock(dirCacheMutex);
+        std::shared_ptr<Dir_t> *cachedDir = dirCache.get(startCluster);
+        if (cachedDir != nullptr)
+            return *cachedDir;
+
+        // a dir changed in a transaction stays in memory even if it's evicted
+        auto it = dirtyDirs.find(startCluster);
+        if (it != dirtyDirs.end()) {
+            dirCache.put(startCluster, it->second);
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<Dir_t> dir(new Dir_t);
 
-    // all entries fitted into the first cluster
-    if (dir->header.entryCount <= ENTRIES_IN_CLUSTER_AFTER_DIR_HEADER)
-        return dir;
+    // read the dir's header - contains basic info
+    std::vector<char> data(getDirHeaderSize());
+    disk->readAt(clusterAddr(startCluster), data.data(), getDirHeaderSize());
+    deserializeDirHeader(dir->header, data.data());
+    assert(dir->header.startCluster == startCluster && "cluster does not hold a dir");
 
-    uint32_t remainingEntries = dir->header.entryCount - entriesInFirstCluster;
-    uint32_t clustersNeeded = ceil(static_cast<double>(remainingEntries) / ENTRIES_IN_ONE_CLUSTER);
+    uint32_t entriesInFirstCluster = std::min(dir->header.entryCount, getEntriesInClusterAfterDirHeader());
     uint32_t entryIndex = entriesInFirstCluster;
-    
-    // skip the first cluster (that one has been already handeled)
-    uint32_t currCluster = fat[dir->header.startCluster];
-
-    // process all clusters except the very last one (that one has to be handeled separately)
-    for (uint32_t i = 0; i < clustersNeeded - 1; i++) {
-        disk->setAddr(clusterAddr(currCluster));
-        disk->read(reinterpret_cast<char *>(&dir->entries[entryIndex]), ENTRIES_IN_ONE_CLUSTER * sizeof(DirEntry_t));
-        
-        // move on to the next cluster
+    uint32_t currCluster = startCluster;
+    std::vector<IDiskDriver::IOVec_t> requests;
+    data.resize(static_cast<size_t>(dir->header.entryCount) * getDirEntrySize());
+    dir->clusters.push_back(startCluster);
+
+    // the first entries follow right after the header
+    requests.push_back({clusterAddr(startCluster) + getDirHeaderSize(), data.data(), entriesInFirstCluster * getDirEntrySize()});
+
+    // the other clusters are full of entries except for the very last one
+    while (entryIndex < dir->header.entryCount) {
         currCluster = fat[currCluster];
-        entryIndex += ENTRIES_IN_ONE_CLUSTER;
+        dir->clusters.push_back(currCluster);
+        uint32_t count = std::min(getEntriesInOneCluster(), dir->header.entryCount - entryIndex);
+        requests.push_back({clusterAddr(currCluster), data.data() + static_cast<size_t>(entryIndex) * getDirEntrySize(), count * getDirEntrySize()});
+        entryIndex += count;
     }
 
-    uint32_t offset = 0;
+    // the whole chain is read in one go
+    disk->readv(requests);
 
-    // read the remaining entries from the very last cluster
-    for (; entryIndex < dir->header.entryCount; entryIndex++) {
-        disk->setAddr(clusterAddr(currCluster) + offset);
-        disk->read(reinterpret_cast<char *>(&dir->entries[entryIndex]), sizeof(DirEntry_t));
-        offset += sizeof(DirEntry_t);
+    // a command cut short between writing the dir and the FAT may have
+    // left empty clusters at the end of the chain - they're kept and reused
+    for (currCluster = fat[currCluster]; currCluster != EOF_CLUSTER; currCluster = fat[currCluster]) {
+        assert(currCluster != FREE_CLUSTER && "dir has not been read properly");
+        dir->clusters.push_back(currCluster);
     }
 
-    // check point - make sure we've reached the end
-    currCluster = fat[currCluster];
-    assert(fat[currCluster] == EOF_CLUSTER && "dir has not been read properly");
+    dir->entries.resize(dir->header.entryCount);
+    for (uint32_t i = 0; i < dir->header.entryCount; i++)
+        deserializeDirEntry(dir->entries[i], data.data() + static_cast<size_t>(i) * getDirEntrySize());
+
+    // small dirs are cheaper to scan than to hash
+    if (dir->header.entryCount >= DIR_INDEX_THRESHOLD)
+        buildDirIndex(dir.get());
+
+    // another reader may have loaded the dir in the meantime - there must
+    // be only one copy of it so the changes made to it are not lost (the lookup
+    // is not counted, the miss has been counted already)
+    std::lock_guard<std::mutex> lock(dirCacheMutex);
+    std::shared_ptr<Dir_t> *cachedDir = dirCache.peek(startCluster);
+    if (cachedDir != nullptr)
+        return *cachedDir;
+    dirCache.put(startCluster, dir);
+    return dir;
+}
 
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::shared_ptr<FAT32::Dir_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::loadLiveDir(uint32_t startCluster, uint32_t generation) {
+    // the dir may have been removed since it was looked up (its lock must be held,
+    // rmdir() holds it exclusively) - nullptr if it's gone, its cluster is not even read
+    if (getDirGeneration(startCluster) != generation)
+        return nullptr;
+    return loadDir(startCluster);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::shared_ptr<FAT32::Dir_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::loadDirOf(const DirEntry_t &entry) {
+    // the entry may have been removed since it was looked up (the lock
+    // of the dir holding it must be held) - nullptr if it's gone
+    std::shared_ptr<Dir_t> dir = loadLiveDir(entry.parentStartCluster, entry.parentGeneration);
+    if (dir == nullptr || getEntry(entry.name, dir.get()) != entry)
+        return nullptr;
     return dir;
 }
 
-uint32_t FAT32::getFreeCluster() {
-    for (uint32_t i = 0; i < CLUSTER_COUNT; i++)
-        if (fat[i] == FREE_CLUSTER) {
-            fat[i] = TAKEN_CLUSTER;
-            return i;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline std::shared_mutex &FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getDirLock(uint32_t startCluster) {
+    return dirLocks[startCluster % DIR_LOCK_STRIPES];
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getDirGeneration(uint32_t startCluster) {
+    std::lock_guard<std::mutex> lock(dirCacheMutex);
+    auto it = dirGenerations.find(startCluster);
+    return it == dirGenerations.end() ? 0 : it->second;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::setGenerations(DirEntry_t &entry, uint32_t parentGeneration) {
+    // the lock of the dir holding the entry must be held, so the dir
+    // the entry points to cannot be removed meanwhile
+    entry.parentGeneration = parentGeneration;
+    if (entry.directory)
+        entry.generation = getDirGeneration(entry.startCluster);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::retireDir(uint32_t startCluster) {
+    // the dir's lock is held exclusively - it's done before its cluster is freed,
+    // so a new dir started at the cluster gets the next generation right away
+    std::lock_guard<std::mutex> lock(dirCacheMutex);
+    dirGenerations[startCluster]++;
+    dirCache.erase(startCluster);
+    dirtyDirs.erase(startCluster);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::resetFreeMap() {
+    freeMap.clear();
+    mappedFreeClusters = 0;
+    freeHint = 0;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::scanFatPage() {
+    // the free map grows by one page of the FAT at a time
+    uint32_t first = freeMap.size() * 64;
+    uint32_t last = std::min<uint64_t>(static_cast<uint64_t>(first) + FAT_PAGE_ENTRIES, clusterCount);
+    assert(first < clusterCount && "the whole FAT has been scanned");
+    freeMap.resize(freeMap.size() + FAT_PAGE_ENTRIES / 64, 0);
+
+    for (uint32_t i = first; i < last; i++) {
+        if (fat[i] == FREE_CLUSTER && (heldClusters.empty() || heldClusters.count(i) == 0)) {
+            freeMap[i / 64] |= 1ULL << (i % 64);
+            mappedFreeClusters++;
         }
-    return ALL_CLUSTERS_TAKEN;
+    }
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::scanForFreeClusters(uint32_t n) {
+    // more of the FAT is scanned only when the free clusters found so far are not enough
+    while (mappedFreeClusters < n && static_cast<uint64_t>(freeMap.size()) * 64 < clusterCount)
+        scanFatPage();
 }
 
-bool FAT32::existsNumberOfFreeClusters(uint32_t n) const {
-    uint32_t freeClusters = 0;
-    for (auto &cluster : fat) {
-        freeClusters += (cluster == FREE_CLUSTER);
-        if (freeClusters == n)
-            return true;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::isScanned(uint32_t index) const {
+    return index / 64 < freeMap.size();
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::setFatEntry(uint32_t index, uint32_t value) {
+    assert(index < clusterCount && "cluster index out of range");
+    bool wasFree = fat[index] == FREE_CLUSTER;
+    bool isFree = value == FREE_CLUSTER;
+    markSummaryDirty();
+
+    // clusters freed in a transaction are not reused before it's committed and they keep
+    // their entries in the table until then - the table goes to the disk before the dirs
+    // do, so the dirs on the disk never point to clusters marked as free
+    if (isFree && !wasFree && transactionOpen) {
+        std::lock_guard<std::mutex> lock(allocMutex);
+        if (newClusters.erase(index) == 0) {
+            heldClusters.insert(index);
+            return;
+        }
     }
-    return false;
+    fat.set(index, value);
+    if (wasFree == isFree)
+        return;
+    if (isFree) {
+        freeClusters++;
+    } else {
+        // the cluster left the free map when it was handed out by the allocator
+        freeClusters--;
+        if (transactionOpen) {
+            std::lock_guard<std::mutex> lock(allocMutex);
+            newClusters.insert(index);
+        }
+        return;
+    }
+
+    // keep the free cluster index in sync with the table (the rest
+    // of the table will be picked up once it's scanned)
+    std::lock_guard<std::mutex> lock(allocMutex);
+    if (isScanned(index))
+        markFree({index, 1});
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::setShareCount(uint32_t index, uint16_t value) {
+    assert(index < clusterCount && "cluster index out of range");
+    markSummaryDirty();
+    if (shares[index] == 0 && value > 0)
+        sharedClusters++;
+    else if (shares[index] > 0 && value == 0)
+        sharedClusters--;
+    shares.set(index, value);
 }
 
-void FAT32::freeAllOccupiedClusters(uint32_t startCluster) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getFreeCluster() {
+    std::vector<Extent_t> extents = allocateClusters(1);
+    return extents.empty() ? ALL_CLUSTERS_TAKEN : extents[0].start;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::findFreeRun(uint32_t from, uint32_t &length) const {
+    length = 0;
+    uint32_t word = from / 64;
+    if (word >= freeMap.size())
+        return clusterCount;
+
+    // find the first free cluster at or after the given index
+    uint64_t bits = freeMap[word] & (~0ULL << (from % 64));
+    while (bits == 0) {
+        if (++word == freeMap.size())
+            return clusterCount;
+        bits = freeMap[word];
+    }
+    uint32_t start = word * 64 + std::countr_zero(bits);
+
+    // the run ends at the first taken cluster that follows (bits past
+    // the end of the table or of its scanned part are never set)
+    bits = ~freeMap[word] & (~0ULL << (start % 64));
+    while (bits == 0) {
+        if (++word == freeMap.size()) {
+            length = std::min<uint64_t>(static_cast<uint64_t>(word) * 64, clusterCount) - start;
+            return start;
+        }
+        bits = ~freeMap[word];
+    }
+    length = std::min(word * 64 + static_cast<uint32_t>(std::countr_zero(bits)), clusterCount) - start;
+    return start;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::markFree(const Extent_t &extent) {
+    // a freed cluster may have been picked up by a scan of its page already
+    for (uint32_t cluster = extent.start; cluster < extent.start + extent.count; cluster++) {
+        uint64_t bit = 1ULL << (cluster % 64);
+        if ((freeMap[cluster / 64] & bit) == 0) {
+            freeMap[cluster / 64] |= bit;
+            mappedFreeClusters++;
+        }
+    }
+    if (extent.start / 64 < freeHint)
+        freeHint = extent.start / 64;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<FAT32::Extent_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::takeFreeClusters(uint32_t n) {
+    std::lock_guard<std::mutex> lock(allocMutex);
+    scanForFreeClusters(n);
+    if (mappedFreeClusters < n)
+        return {};
+
+    // words before the hint are known to be fully taken
+    while (freeHint < freeMap.size() && freeMap[freeHint] == 0)
+        freeHint++;
+
+    std::vector<Extent_t> extents;
+    std::vector<Extent_t> runs;
+    uint32_t length;
+
+    // first fit - look for a single run that can hold all the clusters, the rest
+    // of the FAT is scanned page by page until one is found (or it's all been scanned)
+    uint32_t from = freeHint * 64;
+    while (true) {
+        for (uint32_t start = findFreeRun(from, length); start < clusterCount; start = findFreeRun(start + length, length)) {
+            if (length >= n) {
+                extents.push_back({start, n});
+                break;
+            }
+            runs.push_back({start, length});
+        }
+        uint64_t scannedEnd = static_cast<uint64_t>(freeMap.size()) * 64;
+        if (!extents.empty() || scannedEnd >= clusterCount)
+            break;
+
+        // the run at the end of the scanned part may go on in the next page
+        from = scannedEnd;
+        if (!runs.empty() && runs.back().start + runs.back().count == scannedEnd) {
+            from = runs.back().start;
+            runs.pop_back();
+        }
+        scanFatPage();
+    }
+
+    // otherwise take the longest runs first, which gives the fewest extents
+    if (extents.empty()) {
+        std::sort(runs.begin(), runs.end(), [](const Extent_t &a, const Extent_t &b) {
+            return a.count > b.count;
+        });
+        uint32_t remaining = n;
+        for (uint32_t i = 0; remaining > 0; i++) {
+            uint32_t count = std::min(remaining, runs[i].count);
+            extents.push_back({runs[i].start, count});
+            remaining -= count;
+        }
+
+        // keep the chain in ascending order so it's read sequentially
+        std::sort(extents.begin(), extents.end(), [](const Extent_t &a, const Extent_t &b) {
+            return a.start < b.start;
+        });
+    }
+
+    // the clusters are now out of the free map (they're still free in the FAT)
+    for (auto &extent : extents)
+        for (uint32_t cluster = extent.start; cluster < extent.start + extent.count; cluster++)
+            freeMap[cluster / 64] &= ~(1ULL << (cluster % 64));
+    mappedFreeClusters -= n;
+    return extents;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<FAT32::Extent_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::takeReservedClusters(Reservation_t &reservation, uint32_t n) {
+    std::vector<Extent_t> extents;
+    uint32_t remaining = n;
+
+    while (remaining > 0) {
+        Extent_t &front = reservation.extents.front();
+        uint32_t count = std::min(remaining, front.count);
+        extents.push_back({front.start, count});
+        front.start += count;
+        front.count -= count;
+        if (front.count == 0)
+            reservation.extents.erase(reservation.extents.begin());
+        remaining -= count;
+    }
+    reservation.count -= n;
+    return extents;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::releaseReservations() {
+    // the slots are always locked in the same order
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto &reservation : reservations)
+        locks.emplace_back(reservation.mutex);
+
+    std::lock_guard<std::mutex> lock(allocMutex);
+    for (auto &reservation : reservations) {
+        for (auto &extent : reservation.extents)
+            markFree(extent);
+        reservation.extents.clear();
+        reservation.count = 0;
+    }
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<FAT32::Extent_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::allocateClusters(uint32_t n) {
+    assert(n > 0 && "nothing to allocate");
+    std::vector<Extent_t> extents;
+
+    // small chains come from the clusters reserved for this thread so
+    // threads allocating at the same time don't wait for one another
+    if (n <= RESERVATION_SIZE) {
+        Reservation_t &reservation = reservations[getThreadSlot() % ALLOC_SLOTS];
+        std::lock_guard<std::mutex> lock(reservation.mutex);
+        if (reservation.count < n) {
+            for (auto &extent : takeFreeClusters(RESERVATION_SIZE)) {
+                reservation.extents.push_back(extent);
+                reservation.count += extent.count;
+            }
+        }
+        if (reservation.count >= n)
+            extents = takeReservedClusters(reservation, n);
+    }
+
+    // the rest of the free clusters may be reserved by other threads
+    if (extents.empty())
+        extents = takeFreeClusters(n);
+    if (extents.empty()) {
+        releaseReservations();
+        extents = takeFreeClusters(n);
+    }
+
+    // the clusters are taken out of the free map under allocMutex, so either
+    // all of them are handed out or none of them is (and the caller is told)
+    if (extents.empty())
+        return extents;
+
+    // link up all the clusters into a single chain
+    uint32_t prevCluster = ALL_CLUSTERS_TAKEN;
+    for (auto &extent : extents) {
+        for (uint32_t cluster = extent.start; cluster < extent.start + extent.count; cluster++) {
+            if (prevCluster != ALL_CLUSTERS_TAKEN)
+                setFatEntry(prevCluster, cluster);
+            prevCluster = cluster;
+        }
+    }
+    setFatEntry(prevCluster, EOF_CLUSTER);
+    return extents;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<FAT32::Extent_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getExtents(uint32_t startCluster, uint32_t clusterCount) {
+    std::vector<Extent_t> extents;
     uint32_t currCluster = startCluster;
-    uint32_t prevCluster;
 
+    for (uint32_t i = 0; i < clusterCount; i++) {
+        // merge consecutive clusters into one extent
+        if (!extents.empty() && extents.back().start + extents.back().count == currCluster) {
+            extents.back().count++;
+        } else {
+            extents.push_back({currCluster, 1});
+        }
+        currCluster = fat[currCluster];
+    }
+    return extents;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<IDiskDriver::IOVec_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getIORequests(const std::vector<Extent_t> &extents, char *buffer, uint64_t size, uint64_t offset) {
+    std::vector<IDiskDriver::IOVec_t> requests;
+    uint64_t done = 0;
+
+    // the buffer holds the data starting at the given offset within
+    // the chain and it's spread over the extents one after another
+    for (auto &extent : extents) {
+        uint64_t extentSize = static_cast<uint64_t>(extent.count) * getClusterSize();
+        if (offset >= extentSize) {
+            offset -= extentSize;
+            continue;
+        }
+        uint64_t bytes = std::min(size - done, extentSize - offset);
+        if (bytes == 0)
+            break;
+        requests.push_back({clusterAddr(extent.start) + offset, buffer + done, bytes});
+        done += bytes;
+        offset = 0;
+    }
+    return requests;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getClusterCount(uint64_t size) const {
+    // even an empty file takes up one cluster
+    return std::max<uint64_t>(1, (size + getClusterSize() - 1) / getClusterSize());
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::freeAllOccupiedClusters(uint32_t startCluster) {
     // skip the first cluster so the entries will always
     // have the same firstCluster once they're created
-    currCluster = fat[currCluster]; 
-    
-    while (fat[currCluster] != EOF_CLUSTER && fat[currCluster] != FREE_CLUSTER) {
-        prevCluster = currCluster;
-        currCluster = fat[currCluster];
-        fat[prevCluster] = FREE_CLUSTER;
+    uint32_t currCluster = fat[startCluster];
+
+    while (currCluster != EOF_CLUSTER) {
+        uint32_t nextCluster = fat[currCluster];
+        setFatEntry(currCluster, FREE_CLUSTER);
+        currCluster = nextCluster;
     }
-    fat[currCluster] = FREE_CLUSTER;
 }
 
-FAT32::Dir_t *FAT32::createEmptyDir(std::string name, uint32_t parentStartCluster) {
-    // the dir's header will defo take one cluster
-    // also there must bu an ending cluster => min clusters required = 2
-    assert(existsNumberOfFreeClusters(2) && "not enough free clusters");
-    
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::releaseFileClusters(uint32_t startCluster) {
+    uint32_t currCluster = startCluster;
+
+    // a cluster shared with other files only loses one owner, the rest are freed
+    // (nobody can share a cluster of this file meanwhile, but the other owners
+    // of a shared one may be releasing it at the same time)
+    while (currCluster != EOF_CLUSTER) {
+        uint32_t nextCluster = fat[currCluster];
+        std::unique_lock<std::mutex> lock(shareMutex, std::defer_lock);
+        if (shares[currCluster] > 0)
+            lock.lock();
+        if (shares[currCluster] > 0) {
+            setShareCount(currCluster, shares[currCluster] - 1);
+        } else {
+            setFatEntry(currCluster, FREE_CLUSTER);
+        }
+        currCluster = nextCluster;
+    }
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::Dir_t *FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::createEmptyDir(std::string name, uint32_t parentStartCluster) {
+    // the dir's header will defo take one cluster (nullptr if there's none left)
+    uint32_t startCluster = getFreeCluster();
+    if (startCluster == ALL_CLUSTERS_TAKEN)
+        return nullptr;
+
     Dir_t *dir = new Dir_t;
-    strcpy(dir->header.name, name.c_str());
+    dir->header.name = name;
 
     dir->header.entryCount = 0;
-    dir->header.startCluster = getFreeCluster();
+    dir->header.startCluster = startCluster;
     dir->header.parentStartCluster = parentStartCluster;
-    dir->entries = nullptr;
-
-    uint32_t eofCluster = getFreeCluster();
-    fat[dir->header.startCluster] = eofCluster;
-    fat[eofCluster] = EOF_CLUSTER;
+    dir->clusters.push_back(dir->header.startCluster);
+    setFatEntry(dir->header.startCluster, EOF_CLUSTER);
     return dir;
 }
 
-FAT32::DirEntry_t FAT32::createEntry(Dir_t *dir) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::createEntry(Dir_t *dir) {
+    // the dir's lock must be held (its parent cannot be removed while it's in there)
     assert(dir != nullptr && "dir is null");
     DirEntry_t entry;
-    strcpy(entry.name, dir->header.name);
+    entry.name = dir->header.name;
     entry.startCluster = dir->header.startCluster;
     entry.parentStartCluster = dir->header.parentStartCluster;
-    entry.size = sizeof(Dir_t);
+    entry.size = getDirHeaderSize();
     entry.directory = true;
+    entry.generation = getDirGeneration(entry.startCluster);
+    entry.parentGeneration = getDirGeneration(entry.parentStartCluster);
     return entry;
 }
 
-FAT32::DirEntry_t FAT32::getEntry(std::string name, Dir_t *dir) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::buildDirIndex(Dir_t *dir) {
+    dir->index.clear();
+    dir->index.reserve(dir->header.entryCount);
+    for (uint32_t i = 0; i < dir->header.entryCount; i++)
+        dir->index.emplace(dir->entries[i].name, i);
+    dir->indexed = true;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::findEntry(Dir_t *dir, const std::string &name) {
     assert(dir != nullptr && "dir is null");
-    if (dir->header.entryCount == 0)
-        return NULL_DIR_ENTRY;
-    for (uint32_t i = 0; i < dir->header.entryCount; i++) {
-        if (strcmp(dir->entries[i].name, name.c_str()) == 0)
-            return dir->entries[i];
+    if (dir->indexed) {
+        auto it = dir->index.find(name);
+        return it == dir->index.end() ? dir->header.entryCount : it->second;
     }
-    return NULL_DIR_ENTRY;
+    for (uint32_t i = 0; i < dir->header.entryCount; i++)
+        if (dir->entries[i].name == name)
+            return i;
+    return dir->header.entryCount;
 }
 
-void FAT32::addEntryIntoDir(Dir_t *dir, DirEntry_t *entry) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getEntry(std::string name, Dir_t *dir) {
+    uint32_t p = findEntry(dir, name);
+    if (p == dir->header.entryCount)
+        return NULL_DIR_ENTRY;
+    return dir->entries[p];
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::addEntryIntoDir(Dir_t *dir, DirEntry_t *entry) {
     assert(dir != nullptr && "dir is null");
     assert(entry != nullptr && "entry is null");
+    assert(entry->name.length() <= getMaxNameLen() && "name is too long");
     assert(getEntry(entry->name, dir) == NULL_DIR_ENTRY && "names is already taken");
     
-    entry->parentStartCluster = dir->header.startCluster;
-
-    if (dir->header.entryCount == 0) {
-        dir->header.entryCount++;
-        dir->entries = new DirEntry_t[1];
-        dir->entries[0] = *entry;
-    } else {
-        uint32_t n = dir->header.entryCount;
-        DirEntry_t *entries = new DirEntry_t[n+1];
+    uint32_t index = dir->header.entryCount;
+
+    // the last cluster is full - a new one is attached behind it
+    // (the dir is left as it was if there's none left)
+    if (dir->clusters.size() < getDirClustersNeeded(index + 1)) {
+        uint32_t newCluster = getFreeCluster();
+        if (newCluster == ALL_CLUSTERS_TAKEN)
+            return false;
+        setFatEntry(dir->clusters.back(), newCluster);
+        setFatEntry(newCluster, EOF_CLUSTER);
+        dir->clusters.push_back(newCluster);
+    }
 
-        // copy all previous entries
-        for (uint32_t i = 0; i < n; i++)
-            entries[i] = dir->entries[i];
+    entry->parentStartCluster = dir->header.startCluster;
+    dir->entries.push_back(*entry);
+    dir->header.entryCount++;
+    if (dir->indexed) {
+        dir->index.emplace(entry->name, index);
+    } else if (dir->header.entryCount >= DIR_INDEX_THRESHOLD) {
+        buildDirIndex(dir);
+    }
+    saveDirEntry(dir, index);
+    saveDirHeader(dir);
+    return true;
+}
 
-        // add the new one to the last position
-        entries[n] = *entry;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::replaceEntryInDir(Dir_t *dir, DirEntry_t *prevEntry, DirEntry_t *entry) {
+    assert(dir != nullptr && "dir is null");
+    assert(prevEntry != nullptr && entry != nullptr && "entry is null");
+    assert(prevEntry->name == entry->name && "entries have different names");
 
-        dir->header.entryCount++;
-        delete[] dir->entries;
-        dir->entries = entries;
-    }
-    saveDir(dir);
+    // the entry takes the place of the previous one, so the dir needs no more clusters
+    uint32_t p = findEntry(dir, prevEntry->name);
+    assert(p < dir->header.entryCount && "entry not found");
+    entry->parentStartCluster = dir->header.startCluster;
+    dir->entries[p] = *entry;
+    saveDirEntry(dir, p);
 }
 
-void FAT32::printDir(Dir_t *dir) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::printDir(Dir_t *dir) {
     assert(dir != nullptr && "dir is null");
     if (dir->header.entryCount == 0)
         return;
@@ -318,7 +1120,8 @@ void FAT32::printDir(Dir_t *dir) {
         printDirEntry(&dir->entries[i]);
 }
 
-void FAT32::printDirEntry(DirEntry_t *entry) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::printDirEntry(DirEntry_t *entry) {
     assert(entry != nullptr && "entry is null");
     std::cout << (entry->directory ? "[+]" : "[-]") << std::setw(LS_SPACING)
               << entry->size << std::setw(LS_SPACING)
@@ -327,8 +1130,9 @@ void FAT32::printDirEntry(DirEntry_t *entry) {
               <<  entry->name << '\n';
 }
 
-void FAT32::printFAT() {
-    for (uint32_t i = 0; i < fat.size(); i++) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::printFAT() {
+    for (uint32_t i = 0; i < clusterCount; i++) {
         cout << i << " | ";
         switch (fat[i]) {
             case FREE_CLUSTER:
@@ -357,168 +1161,343 @@ static std::vector<std::string> split(const std::string& s, char c) {
     return move(tokens);
 }
 
-FAT32::DirEntry_t FAT32::getEntry(std::string path) {
+static void lockBoth(std::unique_lock<std::shared_mutex> &first, std::unique_lock<std::shared_mutex> &second) {
+    // std::lock() backs off instead of waiting while holding one of them
+    if (first.mutex() == second.mutex()) {
+        first.lock();
+    } else {
+        std::lock(first, second);
+    }
+}
+
+static ThreadPool &getTransferPool() {
+    static ThreadPool pool(std::max(FAT32::MIN_TRANSFER_THREADS, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+static void reportPathNotFound() {
+    // also when the path led somewhere but it has been removed by another thread meanwhile
+    std::cout << "path not found\n";
+}
+
+static FAT32::DirEntry_t parentOf(const FAT32::DirEntry_t &entry) {
+    // refers to the dir holding the entry (only its cluster and generation are known)
+    FAT32::DirEntry_t parent;
+    parent.startCluster = entry.parentStartCluster;
+    parent.generation = entry.parentGeneration;
+    return parent;
+}
+
+static void reportNotEnoughSpace() {
+    // the clusters are taken before anything is changed, so nothing has been changed
+    std::cout << "not enough free clusters\n";
+}
+
+static void reportSkipped(const std::string &path, const char *reason) {
+    // the other files of the command go on without it
+    std::cout << path << ": " << reason << ", skipped\n";
+}
+
+static void runParallel(size_t count, const std::function<void(size_t)> &task) {
+    // only a limited number of files is being transferred at a time, the next one
+    // is let in as soon as one of them is done (so a large tree neither queues all
+    // of its files in the pool nor holds the buffers of all of them at once)
+    std::counting_semaphore<FAT32::TRANSFER_PIPELINE_DEPTH> slots(FAT32::TRANSFER_PIPELINE_DEPTH);
+    std::latch finished(count);
+    for (size_t i = 0; i < count; i++) {
+        slots.acquire();
+        getTransferPool().submit([&, i] {
+            task(i);
+            slots.release();
+            finished.count_down();
+        });
+    }
+    finished.wait();
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getEntry(const DirEntry_t &workingDir, std::string path) {
     assert(path.length() > 0 && "invalid path");
-    std::unique_ptr<Dir_t> workingDir(loadDir(workingDirStartCluster));
     if (path == ".") {
-        return createEntry(workingDir.get());
+        return getDirEntry(workingDir);
     }
     if (path == "..") {
-        std::unique_ptr<Dir_t> parentDir(loadDir(workingDir->header.parentStartCluster));
-        return createEntry(parentDir.get());
+        return getParentEntry(workingDir);
     }
-    
-    DirEntry_t entry;
-    Dir_t *currDir;
-    Dir_t *tmpDir;
-    Dir_t *parentDir;
-    bool absolute = path[0] == '/';
 
-    if (absolute) {
-        currDir = loadDir(ROOT_DIR_CLUSTER_INDEX);
-    } else {
-        currDir = loadDir(workingDir->header.startCluster);
-    }
-    entry = createEntry(currDir);
+    // only one dir is locked at a time while walking down the path (NULL_DIR_ENTRY
+    // also if one of the dirs on the way has been removed by another thread meanwhile)
+    bool absolute = path[0] == '/';
+    DirEntry_t entry = absolute ? getRootDir() : getDirEntry(workingDir);
+    if (entry == NULL_DIR_ENTRY)
+        return NULL_DIR_ENTRY;
 
     std::vector<std::string> tokens = split(path, '/');
     for (uint32_t i = 0; i < tokens.size(); i++) {
         if (tokens[i] == ".") {
             continue;
         } else if (tokens[i] == "..") {
-            parentDir = loadDir(currDir->header.parentStartCluster);
-            entry = createEntry(parentDir);
-            delete parentDir;
+            entry = getParentEntry(entry);
         } else {
-            entry = getEntry(tokens[i], currDir);
+            entry = lookupEntry(entry, tokens[i]);
         }
-        if (entry == NULL_DIR_ENTRY || (i < (tokens.size() - 1) && entry.directory == false)) {
-            delete currDir;
+        if (entry == NULL_DIR_ENTRY || (i < (tokens.size() - 1) && entry.directory == false))
             return NULL_DIR_ENTRY;
-        }
-        if (i == tokens.size() - 1 && entry.directory == false)
-            break;
-        tmpDir = currDir;
-        currDir = loadDir(entry.startCluster);
-        delete tmpDir;
     }
-    delete currDir;
     return entry;
 }
 
-void FAT32::removeEntryFromDir(Dir_t*dir, DirEntry_t *entry) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getRootDir() {
+    // the root dir is never removed, so it's always the first one at its cluster
+    DirEntry_t root;
+    root.startCluster = ROOT_DIR_CLUSTER_INDEX;
+    return getDirEntry(root);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getDirEntry(const DirEntry_t &dir) {
+    std::shared_lock<std::shared_mutex> lock(getDirLock(dir.startCluster));
+    std::shared_ptr<Dir_t> liveDir = loadLiveDir(dir.startCluster, dir.generation);
+    return liveDir == nullptr ? NULL_DIR_ENTRY : createEntry(liveDir.get());
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getParentEntry(const DirEntry_t &dir) {
+    DirEntry_t entry = getDirEntry(dir);
+    if (entry == NULL_DIR_ENTRY)
+        return NULL_DIR_ENTRY;
+    return getDirEntry(parentOf(entry));
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::lookupEntry(const DirEntry_t &dir, const std::string &name) {
+    std::shared_lock<std::shared_mutex> lock(getDirLock(dir.startCluster));
+    std::shared_ptr<Dir_t> liveDir = loadLiveDir(dir.startCluster, dir.generation);
+    if (liveDir == nullptr)
+        return NULL_DIR_ENTRY;
+    DirEntry_t entry = getEntry(name, liveDir.get());
+    if (entry != NULL_DIR_ENTRY)
+        setGenerations(entry, dir.generation);
+    return entry;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getParentDir(const DirEntry_t &workingDir, const std::string &path, DirEntry_t &dir) {
+    size_t pos = path.find_last_of('/');
+    if (pos == std::string::npos) {
+        dir = workingDir;
+        return true;
+    }
+
+    DirEntry_t entry = getEntry(workingDir, path.substr(0, pos + 1));
+    if (entry == NULL_DIR_ENTRY)
+        return false;
+    assert(entry.directory == true && "cannot insert into a file");
+    dir = entry;
+    return true;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getTarget(const DirEntry_t &workingDir, const std::string &des, const std::string &src, DirEntry_t &dir, std::string &name) {
+    /*
+       POSSIBLE OPTIONS:
+       (1) /data       <- into a folder (under the same name)
+       (1) /data/      <- into a folder (under the same name)
+       (2) /data/file  <- into a folder (under a new name)
+       (3) /data/file1 <- into a folder (overwrite an existing file)
+    */
+    DirEntry_t destEntry = getEntry(workingDir, des);
+
+    if (destEntry == NULL_DIR_ENTRY) {
+        // (2)
+        name = getFileName(des);
+        return getParentDir(workingDir, des, dir);
+    } else if (destEntry.directory == true) {
+        // (1)
+        dir = destEntry;
+        name = getFileName(src);
+    } else {
+        // (3)
+        dir = parentOf(destEntry);
+        name = destEntry.name;
+    }
+    return true;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::removeEntryFromDir(Dir_t*dir, DirEntry_t *entry) {
     assert(dir != nullptr && "dir is null");
     assert(entry != nullptr && "entry is null");
     
     // find the possition of the entry to delete
-    uint32_t p = 0;
-    for (; p < dir->header.entryCount; p++)
-        if (strcmp(dir->entries[p].name, entry->name) == 0)
-            break;
-
-    uint32_t index = 0;
-    uint32_t n = dir->header.entryCount;
-    DirEntry_t *prevEntries = dir->entries;
-    DirEntry_t *entries = new DirEntry_t[n-1];
-
-    // copy all entries except the one to be deleted
-    for (uint32_t i = 0; i < n; i++)
-        if (i != p)
-            entries[index++] = dir->entries[i];
-    
-    // update the parent dir
+    uint32_t p = findEntry(dir, entry->name);
+    assert(p < dir->header.entryCount && "entry not found");
+    if (dir->indexed)
+        dir->index.erase(dir->entries[p].name);
+
+    // move the very last entry into the hole
+    uint32_t last = dir->header.entryCount - 1;
+    if (p != last) {
+        dir->entries[p] = dir->entries[last];
+        if (dir->indexed)
+            dir->index[dir->entries[p].name] = p;
+        saveDirEntry(dir, p);
+    }
+    dir->entries.pop_back();
     dir->header.entryCount--;
-    dir->entries = entries;
-    delete[] prevEntries;
-
-    saveDir(dir);
+    saveDirHeader(dir);
+
+    // the last cluster is now empty - it's released and
+    // the one before it becomes the end of the chain
+    while (dir->clusters.size() > getDirClustersNeeded(dir->header.entryCount)) {
+        uint32_t lastCluster = dir->clusters.back();
+        dir->clusters.pop_back();
+        setFatEntry(lastCluster, FREE_CLUSTER);
+        setFatEntry(dir->clusters.back(), EOF_CLUSTER);
+    }
 }
 
-void FAT32::mkdir(std::string name) {
-    DirEntry_t entry = getEntry(name);
-    assert(entry == NULL_DIR_ENTRY && "name is already taken");
-    uint32_t dirStartCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::mkdir(const DirEntry_t &workingDir, std::string name) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    assert(getEntry(workingDir, name) == NULL_DIR_ENTRY && "name is already taken");
+    DirEntry_t parent;
+    if (getParentDir(workingDir, name, parent) == false) {
+        reportPathNotFound();
+        return;
+    }
+    createDirs(parent, {name.substr(name.find_last_of('/') + 1)});
+}
 
-    size_t pos = name.find_last_of('/');
-    if (pos == std::string::npos) {
-        dirStartCluster = workingDirStartCluster;
-    } else {
-        std::string parDir = name.substr(0, pos + 1);
-        entry = getEntry(parDir);
-        assert(entry != NULL_DIR_ENTRY && "target parent dir is NULL");
-        assert(entry.directory == true && "cannot insert into a file");
-        dirStartCluster = entry.startCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<FAT32::DirEntry_t> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::createDirs(const DirEntry_t &parent, const std::vector<std::string> &names) {
+    std::unique_lock<std::shared_mutex> lock(getDirLock(parent.startCluster));
+    std::shared_ptr<Dir_t> parentDir = loadLiveDir(parent.startCluster, parent.generation);
+    std::vector<DirEntry_t> entries;
+    if (parentDir == nullptr) {
+        reportPathNotFound();
+        return entries;
     }
 
-    std::unique_ptr<Dir_t> workingDir(loadDir(dirStartCluster));
-    std::unique_ptr<Dir_t> dir(createEmptyDir(name.substr(pos + 1, name.length() - 1 - pos), workingDir->header.startCluster));
-    entry = createEntry(dir.get());
-    addEntryIntoDir(workingDir.get(), &entry);
-    saveDir(dir.get());
+    for (auto &name : names) {
+        assert(getEntry(name, parentDir.get()) == NULL_DIR_ENTRY && "name is already taken");
+
+        // the new dir is complete before anybody can find it
+        std::shared_ptr<Dir_t> dir(createEmptyDir(name, parent.startCluster));
+        if (dir == nullptr) {
+            reportNotEnoughSpace();
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> cacheLock(dirCacheMutex);
+            dirCache.put(dir->header.startCluster, dir);
+        }
+        saveDirHeader(dir.get());
+
+        // there's no room for its entry in the parent dir, so it's gone again
+        DirEntry_t entry = createEntry(dir.get());
+        if (addEntryIntoDir(parentDir.get(), &entry) == false) {
+            retireDir(dir->header.startCluster);
+            setFatEntry(dir->header.startCluster, FREE_CLUSTER);
+            reportNotEnoughSpace();
+            break;
+        }
+        entries.push_back(entry);
+    }
+    return entries;
 }
 
-void FAT32::ls(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "entry is NULL");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::ls(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
 
     if (entry.directory) {
-        std::unique_ptr<Dir_t> workingDir(loadDir(entry.startCluster));
-        printDir(workingDir.get());
+        std::shared_lock<std::shared_mutex> lock(getDirLock(entry.startCluster));
+        std::shared_ptr<Dir_t> dir = loadLiveDir(entry.startCluster, entry.generation);
+        if (dir == nullptr) {
+            reportPathNotFound();
+            return;
+        }
+        printDir(dir.get());
     } else {
         printDirEntry(&entry);
     }
 }
 
-void FAT32::pwd() {
-    std::cout << getPWD() << "\n";
-}
-
-std::string FAT32::getPWD() {
-    std::unique_ptr<Dir_t> workingDir(loadDir(workingDirStartCluster));
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::string FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getPWD(const DirEntry_t &workingDir) {
     std::string path = "";
-    Dir_t *prevDir;
-    Dir_t *dir = loadDir(workingDir->header.startCluster);
+    DirEntry_t dir = getDirEntry(workingDir);
 
-    while (dir->header.startCluster != ROOT_DIR_CLUSTER_INDEX) {
-        path = "/" + std::string(dir->header.name) + path;
-        prevDir = dir;
-        dir = loadDir(dir->header.parentStartCluster);
-        delete prevDir;
+    while (dir != NULL_DIR_ENTRY && dir.startCluster != ROOT_DIR_CLUSTER_INDEX) {
+        path = "/" + dir.name + path;
+        dir = getParentEntry(dir);
     }
+
+    // the working dir has been removed by another session
+    if (dir == NULL_DIR_ENTRY)
+        return "?";
     if (path == "")
         path = "/";
-    delete dir;
     return path;
 }
 
-void FAT32::cd(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "entry is null");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::cd(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return workingDir;
+    }
     assert(entry.directory == true && "entry is not a directory");
-    workingDirStartCluster = entry.startCluster;
+    return entry;
 }
 
-void FAT32::rmdir(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "entry is null");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::rmdir(const DirEntry_t &workingDir, std::string path) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
     assert(entry.directory == true && "entry is not a directory");
-    
-    std::unique_ptr<Dir_t> dir(loadDir(entry.startCluster));
+
+    // nothing can be added into the dir while it's being removed
+    std::unique_lock<std::shared_mutex> parentLock(getDirLock(entry.parentStartCluster), std::defer_lock);
+    std::unique_lock<std::shared_mutex> lock(getDirLock(entry.startCluster), std::defer_lock);
+    lockBoth(parentLock, lock);
+
+    std::shared_ptr<Dir_t> parentDir = loadDirOf(entry);
+    std::shared_ptr<Dir_t> dir = loadLiveDir(entry.startCluster, entry.generation);
+    if (parentDir == nullptr || dir == nullptr) {
+        reportPathNotFound();
+        return;
+    }
     assert(dir->header.entryCount == 0 && "dir is not empty");
-    std::unique_ptr<Dir_t> parentDir(loadDir(entry.parentStartCluster));
     removeEntryFromDir(parentDir.get(), &entry);
+
+    // whoever is waiting for the dir's lock finds out it's gone
+    retireDir(entry.startCluster);
     freeAllOccupiedClusters(entry.startCluster);
-    fat[entry.startCluster] = FREE_CLUSTER;
+    setFatEntry(entry.startCluster, FREE_CLUSTER);
 }
 
-inline uint32_t FAT32::getFileSize(FILE *file) const {
-    fseek(file, 0, SEEK_END);
-    uint32_t fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+inline uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getFileSize(FILE *file) const {
+    fseeko(file, 0, SEEK_END);
+    uint64_t fileSize = ftello(file);
+    fseeko(file, 0, SEEK_SET);
     return fileSize;
 }
 
-std::string FAT32::getFileName(std::string path) const {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::string FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::getFileName(std::string path) const {
     if (path.back() == '/')
         path.pop_back();
 
@@ -528,352 +1507,806 @@ std::string FAT32::getFileName(std::string path) const {
     return path.substr(pos + 1);
 }
 
-FAT32::DirEntry_t FAT32::createFileEntry(Dir_t *dir, const char *name, uint32_t size) {
-    assert(existsNumberOfFreeClusters(1) && "not enough free clusters");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+FAT32::DirEntry_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::createFileEntry(Dir_t *dir, const std::string &name, uint64_t size, uint32_t startCluster) {
     DirEntry_t entry;
-    entry.startCluster = getFreeCluster();
+    entry.name = name;
+    entry.startCluster = startCluster;
     entry.parentStartCluster = dir->header.startCluster;
     entry.directory = false;
     entry.size = size;
-    strcpy(entry.name, name);
     return entry;
 }
 
-void FAT32::in(std::string path) {
-    FILE *file = fopen(path.c_str(), "rb+");
-    assert(file != nullptr && "file was not found");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+const char *FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::checkImportedFile(const DirEntry_t &dir, const std::string &path) {
+    // done by the calling thread before any of the files is written,
+    // so a bad path is left out instead of failing halfway through
+    std::error_code error;
+    if (std::filesystem::exists(path, error) == false)
+        return "file was not found";
+    // fopen() opens dirs as well, their size would be nonsense
+    if (std::filesystem::is_regular_file(path, error) == false)
+        return "not a regular file";
+    std::string name = getFileName(path);
+    if (name.length() > getMaxNameLen())
+        return "name is too long";
+    if (lookupEntry(dir, name) != NULL_DIR_ENTRY)
+        return "name is already taken";
+    return nullptr;
+}
 
-    uint32_t size = getFileSize(file);
-    uint32_t clustersNeeded = ceil(static_cast<double>(size) / CLUSTER_SIZE);
-    uint32_t lastClusterSize = size % CLUSTER_SIZE;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::importFile(const DirEntry_t &dir, const std::string &path, ImportedFile_t &imported) {
+    // the path has been checked by checkImportedFile()
+    FILE *file = fopen(path.c_str(), "rb");
+    assert(file != nullptr && "file was not found");
     std::string name = getFileName(path);
-    std::unique_ptr<Dir_t> workingDir(loadDir(workingDirStartCluster));
-
-    assert(getEntry(name, workingDir.get()) == NULL_DIR_ENTRY && "name is already taken");
-    // +1 is because of the entry itself, the rest is taken up by the content
-    assert(existsNumberOfFreeClusters(1 + clustersNeeded) && "not enough free clusters");
-
-    DirEntry_t entry = createFileEntry(workingDir.get(), name.c_str(), size);
-    addEntryIntoDir(workingDir.get(), &entry);
-
-    uint32_t prevCluster;
-    uint32_t currCluster = entry.startCluster;
-    uint32_t fileOffset = 0;
-    std::unique_ptr<char> buffer(new char[CLUSTER_SIZE]);
-
-    // the last cluster needs to be handeled separately 
-    for (uint32_t i = 0; i < clustersNeeded - 1; i++) {
-        // read one junk of data from the input file
-        fseek(file, fileOffset, SEEK_SET);
-        fread(buffer.get(), CLUSTER_SIZE, 1, file);
-        fileOffset += CLUSTER_SIZE;
-
-        // store the junk into the current cluster
-        disk->setAddr(clusterAddr(currCluster));
-        disk->write(buffer.get(), CLUSTER_COUNT);
-
-        // move on to the next cluster
-        prevCluster = currCluster;
-        currCluster = getFreeCluster();
-        fat[prevCluster] = currCluster;
-    }
-    // the very last cluster
-    fseek(file, fileOffset, SEEK_SET);
-    fread(buffer.get(), lastClusterSize, 1, file);
-    disk->setAddr(clusterAddr(currCluster));
-    disk->write(buffer.get(), lastClusterSize);
-
-    // the eof cluster
-    prevCluster = currCluster;
-    currCluster = getFreeCluster();
-    fat[prevCluster] = currCluster;
-    fat[currCluster] = EOF_CLUSTER;
+    assert(name.length() <= getMaxNameLen() && "name is too long");
+
+    // reserve as few runs of consecutive clusters as possible
+    uint64_t size = getFileSize(file);
+    std::vector<Extent_t> extents;
+    if (size <= static_cast<uint64_t>(clusterCount) * getClusterSize())
+        extents = allocateClusters(getClusterCount(size));
+    if (extents.empty()) {
+        fclose(file);
+        reportNotEnoughSpace();
+        return false;
+    }
 
+    // a large file is mapped into memory so it's passed on to the disk as a whole
+    // with a single batched write - small ones are just read, as mapping takes the
+    // process-wide lock of the address space the workers would contend for
+    void *mapping = size > IMPORT_CHUNK_SIZE ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(file), 0) : MAP_FAILED;
+    if (mapping != MAP_FAILED) {
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        disk->writev(getIORequests(extents, static_cast<char *>(mapping), size));
+        munmap(mapping, size);
+    } else {
+        // otherwise stream it through in large chunks
+        std::vector<char> buffer(std::min<uint64_t>(size, IMPORT_CHUNK_SIZE));
+        for (uint64_t offset = 0; offset < size; offset += buffer.size()) {
+            buffer.resize(std::min<uint64_t>(size - offset, IMPORT_CHUNK_SIZE));
+            ssize_t bytesRead = pread(fileno(file), buffer.data(), buffer.size(), offset);
+            assert(bytesRead == static_cast<ssize_t>(buffer.size()) && "file could not be read");
+            (void)bytesRead;
+            disk->writev(getIORequests(extents, buffer.data(), buffer.size(), offset));
+        }
+    }
     fclose(file);
-    saveFat();
+    imported = {name, size, extents[0].start};
+    return true;
 }
 
-void FAT32::out(std::string path) {
-    DirEntry_t entry = getEntry(path);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::addImportedFile(const DirEntry_t &dir, const ImportedFile_t &file) {
+    // the dir is locked just for adding the entry, so imports into it can overlap
+    std::unique_lock<std::shared_mutex> lock(getDirLock(dir.startCluster));
+    std::shared_ptr<Dir_t> liveDir = loadLiveDir(dir.startCluster, dir.generation);
+
+    // the dir has been removed while the data was being written
+    if (liveDir == nullptr) {
+        releaseFileClusters(file.startCluster);
+        reportPathNotFound();
+        return false;
+    }
+    // another thread may have taken the name while the data was being written
+    if (getEntry(file.name, liveDir.get()) != NULL_DIR_ENTRY) {
+        releaseFileClusters(file.startCluster);
+        reportSkipped(file.name, "name is already taken");
+        return false;
+    }
+    DirEntry_t entry = createFileEntry(liveDir.get(), file.name, file.size, file.startCluster);
+    if (addEntryIntoDir(liveDir.get(), &entry) == false) {
+        releaseFileClusters(file.startCluster);
+        reportNotEnoughSpace();
+        return false;
+    }
+    return true;
+}
 
-    assert(entry != NULL_DIR_ENTRY && "file not found");
-    assert(entry.directory == false && "target is not a file");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::in(const DirEntry_t &workingDir, std::string path) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
 
-    std::string name = getFileName(path);
-    FILE *file = fopen(name.c_str(), "wb");
-    assert(file != nullptr && "could not open the output file");
-
-    std::unique_ptr<char> buffer(new char[CLUSTER_SIZE]);
-    std::uint32_t currCluster = entry.startCluster;
-    std::uint32_t clusterCount = ceil(static_cast<double>(entry.size) / CLUSTER_SIZE);
-    uint32_t lastClusterSize = entry.size % CLUSTER_SIZE;
-
-    for (uint32_t i = 0; i < clusterCount - 1; i++) {
-        disk->setAddr(clusterAddr(currCluster));
-        disk->read(buffer.get(), CLUSTER_SIZE);
-        fwrite(buffer.get(), CLUSTER_SIZE, 1, file);
-        currCluster = fat[currCluster];
+    const char *problem = checkImportedFile(workingDir, path);
+    if (problem != nullptr) {
+        reportSkipped(path, problem);
+        return 0;
     }
 
-    disk->setAddr(clusterAddr(currCluster));
-    disk->read(buffer.get(), lastClusterSize);
-    buffer.get()[lastClusterSize] = '\0';
-    fwrite(buffer.get(), lastClusterSize, 1, file);
+    // the file shows up in the dir only once all of its data is written
+    ImportedFile_t file;
+    if (importFile(workingDir, path, file) == false || addImportedFile(workingDir, file) == false)
+        return 0;
+    return file.size;
+}
 
-    currCluster = fat[currCluster];
-    assert(fat[currCluster] == EOF_CLUSTER && "file was not read properly");
-    fclose(file);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::in(const DirEntry_t &workingDir, const std::vector<std::string> &paths) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    std::unordered_set<std::string> names;
+    std::vector<ImportJob_t> jobs;
+    for (auto &path : paths) {
+        const char *problem = checkImportedFile(workingDir, path);
+        if (problem == nullptr && names.insert(getFileName(path)).second == false)
+            problem = "name is repeated";
+        if (problem != nullptr) {
+            reportSkipped(path, problem);
+            continue;
+        }
+        jobs.push_back({path, workingDir});
+    }
+    return importFiles(jobs);
 }
 
-void FAT32::cat(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "file not found");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::importFiles(const std::vector<ImportJob_t> &jobs) {
+    // the data of the files is written in parallel, but they're added
+    // into their dirs in the given order (each one as soon as all the
+    // files in front of it are in)
+    std::vector<ImportedFile_t> files(jobs.size());
+    std::vector<uint8_t> written(jobs.size(), false);
+    std::vector<uint8_t> done(jobs.size(), false);
+    size_t nextToAdd = 0;
+    std::mutex addMutex;
+    uint64_t bytes = 0;
+
+    runParallel(jobs.size(), [&](size_t i) {
+        bool ok = importFile(jobs[i].dir, jobs[i].path, files[i]);
+        std::lock_guard<std::mutex> lock(addMutex);
+        written[i] = ok;
+        done[i] = true;
+        while (nextToAdd < jobs.size() && done[nextToAdd]) {
+            if (written[nextToAdd] && addImportedFile(jobs[nextToAdd].dir, files[nextToAdd]))
+                bytes += files[nextToAdd].size;
+            nextToAdd++;
+        }
+    });
+    return bytes;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::inDir(const DirEntry_t &workingDir, std::string path) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    assert(std::filesystem::is_directory(path) && "dir was not found");
+
+    // the dir is named after the last component of its resolved path (path may be . or end with /)
+    std::string name = std::filesystem::canonical(path).filename().string();
+    assert(!name.empty() && name != "." && name != ".." && "dir has no name to be imported under");
+    if (name.length() > getMaxNameLen()) {
+        reportSkipped(path, "name is too long");
+        return 0;
+    }
+    if (lookupEntry(workingDir, name) != NULL_DIR_ENTRY) {
+        reportSkipped(path, "name is already taken");
+        return 0;
+    }
+
+    // the whole tree is walked and checked before anything is created - whatever
+    // can't be imported is reported and left out (a dir with all it holds)
+    struct HostDir_t {
+        std::filesystem::path path;
+        std::vector<size_t> subdirs;
+        std::vector<std::filesystem::path> files;
+    };
+    std::vector<HostDir_t> tree = {{path, {}, {}}};
+    for (size_t i = 0; i < tree.size(); i++) {
+        std::vector<std::filesystem::path> subdirs;
+        std::vector<std::filesystem::path> files;
+        for (auto &entry : std::filesystem::directory_iterator(tree[i].path)) {
+            bool directory = entry.is_symlink() == false && entry.is_directory();
+            const char *problem = nullptr;
+            if (directory == false && entry.is_regular_file() == false)
+                problem = "not a regular file";
+            else if (entry.path().filename().string().length() > getMaxNameLen())
+                problem = "name is too long";
+            if (problem != nullptr)
+                reportSkipped(entry.path().string(), problem);
+            else if (directory)
+                subdirs.push_back(entry.path());
+            else
+                files.push_back(entry.path());
+        }
+        std::sort(subdirs.begin(), subdirs.end());
+        std::sort(files.begin(), files.end());
+        tree[i].files = files;
+        for (auto &subdir : subdirs) {
+            tree[i].subdirs.push_back(tree.size());
+            tree.push_back({subdir, {}, {}});
+        }
+    }
+
+    // the subdirs of each dir are created together level by level and
+    // the files are collected to be imported once all dirs exist
+    std::vector<DirEntry_t> root = createDirs(workingDir, {name});
+    if (root.empty())
+        return 0;
+    std::queue<std::pair<size_t, DirEntry_t>> dirs;
+    dirs.push({0, root[0]});
+    std::vector<ImportJob_t> jobs;
+
+    while (!dirs.empty()) {
+        auto [index, dir] = dirs.front();
+        dirs.pop();
+
+        std::vector<std::string> names;
+        for (auto subdir : tree[index].subdirs)
+            names.push_back(tree[subdir].path.filename().string());
+        // a dir that could not be created (or has been removed by another
+        // thread meanwhile) is left out with all it holds
+        std::vector<DirEntry_t> created = createDirs(dir, names);
+        for (size_t i = 0; i < created.size(); i++)
+            dirs.push({tree[index].subdirs[i], created[i]});
+        for (auto &file : tree[index].files)
+            jobs.push_back({file.string(), dir});
+    }
+    return importFiles(jobs);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::sendFile(const DirEntry_t &entry, int fd) {
+    std::vector<Extent_t> extents = getExtents(entry.startCluster, getClusterCount(entry.size));
+    uint64_t remainingBytes = entry.size;
+
+    // each run of consecutive clusters is passed on in one go
+    for (auto &extent : extents) {
+        uint64_t bytes = std::min(remainingBytes, static_cast<uint64_t>(extent.count) * getClusterSize());
+        if (bytes == 0)
+            break;
+        disk->sendTo(fd, clusterAddr(extent.start), bytes);
+        remainingBytes -= bytes;
+    }
+
+    uint32_t lastCluster = extents.back().start + extents.back().count - 1;
+    assert(fat[lastCluster] == EOF_CLUSTER && "file was not read properly");
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::out(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return 0;
+    }
     assert(entry.directory == false && "target is not a file");
+    return exportFile(entry, getFileName(path)) ? entry.size : 0;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::exportFile(const DirEntry_t &entry, const std::string &path) {
+    // the file cannot be removed while it's being read (nothing is exported if it's gone)
+    std::shared_lock<std::shared_mutex> lock(getDirLock(entry.parentStartCluster));
+    if (loadDirOf(entry) == nullptr) {
+        reportPathNotFound();
+        return false;
+    }
 
-    std::unique_ptr<char> buffer(new char[CLUSTER_SIZE]);
-    std::uint32_t currCluster = entry.startCluster;
-    std::uint32_t clusterCount = ceil(static_cast<double>(entry.size) / CLUSTER_SIZE);
-    uint32_t lastClusterSize = entry.size % CLUSTER_SIZE;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1 && "could not open the output file");
+    sendFile(entry, fd);
+    ::close(fd);
+    return true;
+}
 
-    for (uint32_t i = 0; i < clusterCount - 1; i++) {
-        disk->setAddr(clusterAddr(currCluster));
-        disk->read(buffer.get(), CLUSTER_SIZE);
-        std::cout << buffer.get();
-        currCluster = fat[currCluster];
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+std::vector<std::string> FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::expandPath(const DirEntry_t &workingDir, const std::string &pattern) {
+    // only the name of the file may contain wildcards
+    std::string name = getFileName(pattern);
+    if (name.find_first_of("*?[") == std::string::npos)
+        return {pattern};
+
+    size_t pos = pattern.find_last_of('/');
+    std::string prefix = pos == std::string::npos ? "" : pattern.substr(0, pos + 1);
+    std::vector<std::string> paths;
+    DirEntry_t parent;
+    if (getParentDir(workingDir, pattern, parent) == false)
+        return paths;
+    {
+        std::shared_lock<std::shared_mutex> lock(getDirLock(parent.startCluster));
+        std::shared_ptr<Dir_t> dir = loadLiveDir(parent.startCluster, parent.generation);
+        if (dir == nullptr)
+            return paths;
+        for (auto &entry : dir->entries)
+            if (entry.directory == false && fnmatch(name.c_str(), entry.name.c_str(), 0) == 0)
+                paths.push_back(prefix + entry.name);
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::out(const DirEntry_t &workingDir, const std::vector<std::string> &patterns) {
+    std::vector<ExportJob_t> jobs;
+    for (auto &pattern : patterns) {
+        std::vector<std::string> paths = expandPath(workingDir, pattern);
+        if (paths.empty()) {
+            reportPathNotFound();
+            return 0;
+        }
+        for (auto &path : paths) {
+            DirEntry_t entry = getEntry(workingDir, path);
+            if (entry == NULL_DIR_ENTRY) {
+                reportPathNotFound();
+                return 0;
+            }
+            assert(entry.directory == false && "target is not a file");
+            jobs.push_back({entry, getFileName(path)});
+        }
+    }
+    return exportFiles(jobs);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::exportFiles(const std::vector<ExportJob_t> &jobs) {
+    // two workers must not write into the same file
+    std::unordered_set<std::string> paths;
+    for (auto &job : jobs) {
+        if (paths.insert(job.path).second == false) {
+            std::cout << job.path << ": more than one file would be exported into it\n";
+            return 0;
+        }
     }
-    disk->setAddr(clusterAddr(currCluster));
-    disk->read(buffer.get(), lastClusterSize);
-    buffer.get()[lastClusterSize] = '\0';
-    std::cout << buffer.get();
 
-    currCluster = fat[currCluster];
-    assert(fat[currCluster] == EOF_CLUSTER && "file was not read properly");
+    // nothing changes in the file system, so the files can go out in any order
+    std::atomic<uint64_t> bytes = 0;
+    runParallel(jobs.size(), [&](size_t i) {
+        if (exportFile(jobs[i].entry, jobs[i].path))
+            bytes += jobs[i].entry.size;
+    });
+    return bytes;
 }
 
-void FAT32::rm(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "file not found");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::outDir(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return 0;
+    }
+    assert(entry.directory == true && "target is not a directory");
+
+    // the dir is recreated under its own name (the root dir goes straight into the current one)
+    std::queue<std::pair<DirEntry_t, std::filesystem::path>> dirs;
+    dirs.push({entry, entry.startCluster == ROOT_DIR_CLUSTER_INDEX ? "." : entry.name});
+    std::vector<ExportJob_t> jobs;
+
+    while (!dirs.empty()) {
+        auto [dirEntry, hostDir] = dirs.front();
+        dirs.pop();
+
+        // a dir removed by another thread meanwhile is left out with all it holds
+        std::vector<DirEntry_t> entries;
+        {
+            std::shared_lock<std::shared_mutex> lock(getDirLock(dirEntry.startCluster));
+            std::shared_ptr<Dir_t> dir = loadLiveDir(dirEntry.startCluster, dirEntry.generation);
+            if (dir == nullptr)
+                continue;
+            entries = dir->entries;
+            for (auto &entry : entries)
+                setGenerations(entry, dirEntry.generation);
+        }
+        std::filesystem::create_directories(hostDir);
+        for (auto &entry : entries) {
+            if (entry.directory)
+                dirs.push({entry, hostDir / entry.name});
+            else
+                jobs.push_back({entry, (hostDir / entry.name).string()});
+        }
+    }
+    return exportFiles(jobs);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint64_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::cat(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return 0;
+    }
     assert(entry.directory == false && "target is not a file");
-    
-    std::unique_ptr<Dir_t> dir(loadDir(entry.parentStartCluster));
 
-    removeEntryFromDir(dir.get(), &entry);
-    freeAllOccupiedClusters(entry.startCluster);
+    // whatever has been printed so far must go out first
+    std::shared_lock<std::shared_mutex> lock(getDirLock(entry.parentStartCluster));
+    if (loadDirOf(entry) == nullptr) {
+        reportPathNotFound();
+        return 0;
+    }
+    std::cout.flush();
+    sendFile(entry, STDOUT_FILENO);
+    return entry.size;
+}
 
-    // also we must not forget to delete the very first cluster
-    fat[entry.startCluster] = FREE_CLUSTER;
-    saveFat();
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::rm(const DirEntry_t &workingDir, std::string path) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
+    assert(entry.directory == false && "target is not a file");
+
+    std::unique_lock<std::shared_mutex> lock(getDirLock(entry.parentStartCluster));
+    std::shared_ptr<Dir_t> dir = loadDirOf(entry);
+    if (dir == nullptr) {
+        reportPathNotFound();
+        return;
+    }
+
+    removeEntryFromDir(dir.get(), &entry);
+    releaseFileClusters(entry.startCluster);
 }
 
-void FAT32::cp(std::string des, std::string src) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::cp(const DirEntry_t &workingDir, std::string des, std::string src, bool reflink) {
     // nothing to do
     if (des == src)
         return;
 
     // make sure we're copying a file
-    DirEntry_t file = getEntry(src);
-    assert(file != NULL_DIR_ENTRY && "file not found");
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    DirEntry_t file = getEntry(workingDir, src);
+    if (file == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
     assert(file.directory == false && "cannot move a directory");
 
-    // make sure the a copy of the file would fit into the file system
-    // +1 is because of the entry itself, the rest is taken up by the content
-    uint32_t clustersNeeded = ceil(static_cast<double>(file.size) / CLUSTER_SIZE);
-    assert(existsNumberOfFreeClusters(1 + clustersNeeded) && "not enough free clusters");
-    
-    DirEntry_t destEntry = getEntry(des);
+    DirEntry_t target;
     std::string fileName;
-    size_t lastSlashPos;
-    Dir_t *dir;
+    if (getTarget(workingDir, des, src, target, fileName) == false) {
+        reportPathNotFound();
+        return;
+    }
 
-    if (destEntry == NULL_DIR_ENTRY) {
-        fileName = getFileName(des);
-        lastSlashPos = des.find_last_of('/');
-        DirEntry_t dirEntry;
-        if (lastSlashPos == std::string::npos) {
-            dirEntry = getEntry(getPWD());
-        } else {
-            dirEntry = getEntry(des.substr(0, lastSlashPos + 1));
-        }
-        assert(dirEntry.directory == true && "error when loading target dir");
-        dir = loadDir(dirEntry.startCluster);
-        DirEntry_t newFileEntry = createFileEntry(dir, fileName.c_str(), file.size);
-        addEntryIntoDir(dir, &newFileEntry);
-        copyClusters(file.startCluster, newFileEntry.startCluster);
-        delete dir;
-    } else if (destEntry.directory == true) {
-        fileName = getFileName(src);
-        dir = loadDir(destEntry.startCluster);
-        DirEntry_t prevEntry = getEntry(fileName, dir);
+    std::unique_lock<std::shared_mutex> srcLock(getDirLock(file.parentStartCluster), std::defer_lock);
+    std::unique_lock<std::shared_mutex> desLock(getDirLock(target.startCluster), std::defer_lock);
+    lockBoth(srcLock, desLock);
+    std::shared_ptr<Dir_t> srcDir = loadDirOf(file);
+    std::shared_ptr<Dir_t> dir = loadLiveDir(target.startCluster, target.generation);
+    if (srcDir == nullptr || dir == nullptr) {
+        reportPathNotFound();
+        return;
+    }
+    DirEntry_t prevEntry = getEntry(fileName, dir.get());
 
-        // if there's a file with the same name it will be overwritten
-        if (prevEntry != NULL_DIR_ENTRY) {
-            removeEntryFromDir(dir, &prevEntry);
-            freeAllOccupiedClusters(prevEntry.startCluster);
-
-            // also we must not forget to delete the very first cluster
-            fat[prevEntry.startCluster] = FREE_CLUSTER;
-            saveFat();
-
-            // reload the directory after the file has been deleted
-            delete dir;
-            dir = loadDir(destEntry.startCluster);  
-        }
-        DirEntry_t newFileEntry = createFileEntry(dir, fileName.c_str(), file.size);
-        addEntryIntoDir(dir, &newFileEntry);
-        copyClusters(file.startCluster, newFileEntry.startCluster);
-        delete dir;
-    } else {
-        rm(des);
-        dir = loadDir(destEntry.parentStartCluster);
-        DirEntry_t newFileEntry = createFileEntry(dir, destEntry.name, file.size);
-        addEntryIntoDir(dir, &newFileEntry);
-        copyClusters(file.startCluster, newFileEntry.startCluster);
-        delete dir;
+    // the file would be copied onto itself
+    if (prevEntry == file)
+        return;
+
+    // the copy (a reflink shares the clusters of the original file) is made
+    // before anything is changed, so the copying can fail with nothing to undo
+    assert((prevEntry == NULL_DIR_ENTRY || prevEntry.directory == false) && "cannot overwrite a directory");
+    uint32_t startCluster = copyClusters(file.startCluster, file.size, reflink);
+    if (startCluster == ALL_CLUSTERS_TAKEN) {
+        reportNotEnoughSpace();
+        return;
+    }
+    DirEntry_t newFileEntry = createFileEntry(dir.get(), fileName, file.size, startCluster);
+
+    // if there's a file with the same name it will be overwritten
+    if (prevEntry != NULL_DIR_ENTRY) {
+        replaceEntryInDir(dir.get(), &prevEntry, &newFileEntry);
+        releaseFileClusters(prevEntry.startCluster);
+    } else if (addEntryIntoDir(dir.get(), &newFileEntry) == false) {
+        releaseFileClusters(startCluster);
+        reportNotEnoughSpace();
     }
 }
 
-void FAT32::copyClusters(uint32_t srcStartCluster, uint32_t desStartCluster) {
-    uint32_t currSrcCluster = srcStartCluster;
-    uint32_t currDesCluster = desStartCluster;
-    uint32_t prevDesCluster;
-
-    std::unique_ptr<char> buffer(new char[CLUSTER_SIZE]);
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::copyClusters(uint32_t srcStartCluster, uint64_t size, bool reflink) {
+    if (reflink)
+        return shareClusters(srcStartCluster, size);
+
+    uint32_t clusterCount = getClusterCount(size);
+    std::vector<Extent_t> srcExtents = getExtents(srcStartCluster, clusterCount);
+
+    std::vector<Extent_t> desExtents = allocateClusters(clusterCount);
+    if (desExtents.empty())
+        return ALL_CLUSTERS_TAKEN;
+
+    uint32_t srcIndex = 0;
+    uint32_t desIndex = 0;
+    uint32_t srcOffset = 0;
+    uint32_t desOffset = 0;
+
+    // copy the overlapping parts of the source and destination
+    // extents within the disk (without reading them in here)
+    while (srcIndex < srcExtents.size()) {
+        Extent_t &src = srcExtents[srcIndex];
+        Extent_t &des = desExtents[desIndex];
+        uint32_t count = std::min(src.count - srcOffset, des.count - desOffset);
+        disk->copy(clusterAddr(des.start + desOffset), clusterAddr(src.start + srcOffset), static_cast<uint64_t>(count) * getClusterSize());
+
+        // move on to the next extent(s)
+        srcOffset += count;
+        desOffset += count;
+        if (srcOffset == src.count) {
+            srcIndex++;
+            srcOffset = 0;
+        }
+        if (desOffset == des.count) {
+            desIndex++;
+            desOffset = 0;
+        }
+    }
+    return desExtents[0].start;
+}
 
-    while (fat[currSrcCluster] != EOF_CLUSTER) {
-        disk->setAddr(clusterAddr(currSrcCluster));
-        disk->read(reinterpret_cast<char *>(buffer.get()), CLUSTER_SIZE);
-        disk->setAddr(clusterAddr(currDesCluster));
-        disk->write(reinterpret_cast<const char *>(buffer.get()), CLUSTER_SIZE);
-        
-        // link up the clusters in the FAT table
-        prevDesCluster = currDesCluster;
-        currDesCluster = getFreeCluster();
-        fat[prevDesCluster] = currDesCluster;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+uint32_t FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::shareClusters(uint32_t startCluster, uint64_t size) {
+    uint32_t currCluster = startCluster;
+    std::lock_guard<std::mutex> lock(shareMutex);
 
-        // move on to the next cluster
-        currSrcCluster = fat[currSrcCluster];
+    // the new file points to the same chain - no data is copied
+    // at all, only each cluster gets one more owner
+    for (uint32_t i = 0; i < getClusterCount(size); i++) {
+        assert(shares[currCluster] < MAX_SHARE_COUNT && "cluster is shared too many times");
+        setShareCount(currCluster, shares[currCluster] + 1);
+        currCluster = fat[currCluster];
     }
-    // attaching the EOF cluster
-    fat[currDesCluster] = EOF_CLUSTER;
+    assert(currCluster == EOF_CLUSTER && "file was not read properly");
+    return startCluster;
 }
 
-void FAT32::mv(std::string des, std::string src) { 
-    /* 
-       POSSIBLE OPTIONS:
-       (1) /data       <- mv into a folder (under the same name) 
-       (1) /data/      <- mv into a folder (under the same name) 
-       (2) /data/file  <- mv into a folder (under a new name) 
-       (3) /data/file1 <- mv into a folder (overwrite an existing file) 
-    */
-    
-    DirEntry_t file = getEntry(src);
-    assert(file != NULL_DIR_ENTRY && "file not found");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::mv(const DirEntry_t &workingDir, std::string des, std::string src) {
+    std::shared_lock<std::shared_mutex> syncLock(syncMutex);
+    DirEntry_t file = getEntry(workingDir, src);
+    if (file == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
     assert(file.directory == false && "cannot move a directory");
 
-    // delete the file entirely from its original location
-    Dir_t *dir = loadDir(file.parentStartCluster);
-    removeEntryFromDir(dir, &file);
-    delete dir;
-
-    // load the destination entry
-    DirEntry_t destEntry = getEntry(des);
+    DirEntry_t target;
     std::string fileName;
-    std::string parentDirPath;
-    size_t lastSlashPos;
+    if (getTarget(workingDir, des, src, target, fileName) == false) {
+        reportPathNotFound();
+        return;
+    }
 
-    if (destEntry == NULL_DIR_ENTRY) {
-        // (2)
-        fileName = getFileName(des);
-        lastSlashPos = des.find_last_of('/');
-        DirEntry_t dirEntry;
-        if (lastSlashPos == std::string::npos) {
-            dirEntry = getEntry(getPWD());
-        } else {
-            dirEntry = getEntry(des.substr(0, lastSlashPos + 1));
-        }
-        assert(dirEntry.directory == true && "error when loading target dir");
-        
-        strcpy(file.name, fileName.c_str());
-        dir = loadDir(dirEntry.startCluster);
-        addEntryIntoDir(dir, &file);
-        delete dir;
-    } else if (destEntry.directory == true) {
-        // (1)
-        fileName = getFileName(src);
-        dir = loadDir(destEntry.startCluster);
-        DirEntry_t prevEntry = getEntry(fileName, dir);
+    std::unique_lock<std::shared_mutex> srcLock(getDirLock(file.parentStartCluster), std::defer_lock);
+    std::unique_lock<std::shared_mutex> desLock(getDirLock(target.startCluster), std::defer_lock);
+    lockBoth(srcLock, desLock);
+    std::shared_ptr<Dir_t> srcDir = loadDirOf(file);
+    std::shared_ptr<Dir_t> dir = loadLiveDir(target.startCluster, target.generation);
+    if (srcDir == nullptr || dir == nullptr) {
+        reportPathNotFound();
+        return;
+    }
+    DirEntry_t prevEntry = getEntry(fileName, dir.get());
 
+    // the file would be moved onto itself
+    if (prevEntry == file)
+        return;
+
+    // the file is put into the new dir before it leaves the old one, so
+    // nothing has been changed if the new dir can't take one more entry
+    DirEntry_t movedFile = file;
+    movedFile.name = fileName;
+    if (prevEntry != NULL_DIR_ENTRY) {
         // if there's a file with the same name it will be overwritten
-        if (prevEntry != NULL_DIR_ENTRY) {
-            removeEntryFromDir(dir, &prevEntry);
-            freeAllOccupiedClusters(prevEntry.startCluster);
+        assert(prevEntry.directory == false && "cannot overwrite a directory");
+        replaceEntryInDir(dir.get(), &prevEntry, &movedFile);
+        releaseFileClusters(prevEntry.startCluster);
+    } else if (addEntryIntoDir(dir.get(), &movedFile) == false) {
+        reportNotEnoughSpace();
+        return;
+    }
+    removeEntryFromDir(srcDir.get(), &file);
+}
 
-            // also we must not forget to delete the very first cluster
-            fat[prevEntry.startCluster] = FREE_CLUSTER;
-            saveFat();
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::flush() {
+    // no change is halfway through while the changes are written out
+    std::unique_lock<std::shared_mutex> syncLock(syncMutex);
 
-            // reload the directory after the file has been deleted
-            delete dir;
-            dir = loadDir(destEntry.startCluster);  
-        }
-        // move the file into the new dir
-        addEntryIntoDir(dir, &file);
-        delete dir;
-    } else {
-        // (3)
-        rm(des);
-        dir = loadDir(destEntry.parentStartCluster);
-        strcpy(file.name, destEntry.name);
-        addEntryIntoDir(dir, &file);
-        delete dir;
+    // the changes made in a transaction wait for its commit
+    if (transactionOpen == false)
+        saveChanges(false);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::sync() {
+    std::unique_lock<std::shared_mutex> syncLock(syncMutex);
+    if (transactionOpen == false)
+        saveChanges(true);
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::begin() {
+    // the flushes of other sessions would do nothing until the commit
+    std::lock_guard<std::mutex> sessionLock(sessionMutex);
+    if (sessionCount > 1 || transactionOpen)
+        return false;
+
+    // the changed pages of the tables must not reach the disk before the commit
+    std::unique_lock<std::shared_mutex> syncLock(syncMutex);
+    transactionOpen = true;
+    transactionOwner = std::this_thread::get_id();
+    fat.setHoldDirty(true);
+    shares.setHoldDirty(true);
+    return true;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::commit() {
+    {
+        std::unique_lock<std::shared_mutex> syncLock(syncMutex);
+        assert(transactionOpen && "no transaction to commit");
+        transactionOpen = false;
+        saveChanges(false);
+        fat.setHoldDirty(false);
+        shares.setHoldDirty(false);
     }
+
+    // the sessions waiting to be bound may go on
+    std::lock_guard<std::mutex> sessionLock(sessionMutex);
+    transactionCommitted.notify_all();
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::attachSession() {
+    std::unique_lock<std::mutex> lock(sessionMutex);
+    assert((transactionOpen == false || transactionOwner != std::this_thread::get_id()) && "the transaction would never be committed");
+    transactionCommitted.wait(lock, [this] { return transactionOpen == false; });
+    sessionCount++;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::detachSession() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    assert(sessionCount > 0 && "no session to detach");
+    sessionCount--;
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+bool FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::deferDirWrite(Dir_t *dir) {
+    if (transactionOpen == false)
+        return false;
+
+    // the dir is kept even if it's been evicted from the cache meanwhile - the caller
+    // holds its lock, so this is the only copy of it and loadDir() finds it here
+    std::lock_guard<std::mutex> lock(dirCacheMutex);
+    std::shared_ptr<Dir_t> &dirtyDir = dirtyDirs[dir->header.startCluster];
+    if (dirtyDir.get() != dir)
+        dirtyDir = dir->shared_from_this();
+    return true;
 }
 
-void FAT32::info() {
-    uint32_t freeClusters = 0;
-    for (uint32_t i = 0; i < CLUSTER_COUNT; i++)
-        freeClusters += fat[i] == FREE_CLUSTER;
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveDirtyDirs() {
+    std::vector<std::shared_ptr<Dir_t>> dirs;
+    {
+        std::lock_guard<std::mutex> lock(dirCacheMutex);
+        for (auto &dirtyDir : dirtyDirs)
+            dirs.push_back(dirtyDir.second);
+        dirtyDirs.clear();
+    }
 
-    size_t totalSize = CLUSTER_COUNT * CLUSTER_SIZE;
-    size_t freeSize = freeClusters * CLUSTER_SIZE;
+    // each dir is written as a whole, in the order they lie on the disk
+    std::sort(dirs.begin(), dirs.end(), [](const std::shared_ptr<Dir_t> &a, const std::shared_ptr<Dir_t> &b) {
+        return a->header.startCluster < b->header.startCluster;
+    });
+    for (auto &dir : dirs)
+        saveDir(dir.get());
+}
 
-    std::cout << "total clusters   : " << CLUSTER_COUNT << '\n';
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::releaseHeldClusters() {
+    std::lock_guard<std::mutex> lock(allocMutex);
+    for (auto index : heldClusters) {
+        fat.set(index, FREE_CLUSTER);
+        freeClusters++;
+        if (isScanned(index))
+            markFree({index, 1});
+    }
+    heldClusters.clear();
+    newClusters.clear();
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::saveChanges(bool durable) {
+    // the data of files is already on the disk - the clusters taken go to the FAT
+    // before the dirs pointing to them are written (see saveDir()), the clusters
+    // freed are released only after that, then the summary in the superblock goes last
+    saveDirtyDirs();
+    releaseHeldClusters();
+    releaseReservations();
+    saveFat();
+
+    // the summary stays marked dirty until the disk is synced explicitly (or
+    // unmounted), so the changes in between cost no barriers at all
+    if (durable == false)
+        return;
+
+    // the summary is up to date once all of the FAT is on the disk (the driver
+    // may write the flushed pages in any order, so it waits for all of them)
+    disk->sync();
+    if (summaryDirty) {
+        summaryDirty = false;
+        saveSuperblock(FS_STATE_CLEAN);
+        disk->sync();
+    }
+}
+
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::info() {
+    size_t totalSize = static_cast<size_t>(clusterCount) * getClusterSize();
+    size_t freeSize = static_cast<size_t>(freeClusters) * getClusterSize();
+
+    std::cout << "total clusters   : " << clusterCount << '\n';
     std::cout << "free clusters    : " << freeClusters << '\n';
-    std::cout << "cluster size [B] : " << CLUSTER_SIZE << '\n';
+    std::cout << "cluster size [B] : " << getClusterSize() << '\n';
+    std::cout << "max name length  : " << getMaxNameLen() << '\n';
     std::cout << "total size   [B] : " << totalSize << '\n';
     std::cout << "free size    [B] : " << freeSize << '\n';
     std::cout << "free size    [%] : " << ((freeSize * 100.0) / totalSize) << '\n';
+    std::cout << "shared clusters  : " << sharedClusters << '\n';
+    std::cout << "FAT pages loaded : " << fat.getResidentPages() << '\n';
+
+    std::lock_guard<std::mutex> lock(dirCacheMutex);
+    std::cout << "dir cache hits   : " << dirCache.getHits() << '\n';
+    std::cout << "dir cache misses : " << dirCache.getMisses() << '\n';
 }
 
-void FAT32::tree(std::string path) {
-    DirEntry_t entry = getEntry(path);
-    assert(entry != NULL_DIR_ENTRY && "dir is NULL");
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::tree(const DirEntry_t &workingDir, std::string path) {
+    DirEntry_t entry = getEntry(workingDir, path);
+    if (entry == NULL_DIR_ENTRY) {
+        reportPathNotFound();
+        return;
+    }
     assert(entry.directory && "cannot print tree of a dir");
-    std::unique_ptr<Dir_t> dir(loadDir(entry.startCluster));
-    printTree(dir.get(), 0);
+    printTree(entry, 0);
 }
 
-void FAT32::printTree(Dir_t *dir, uint32_t space) {
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+void FAT32Engine<CLUSTER_SIZE, MAX_NAME_LEN>::printTree(const DirEntry_t &dirEntry, uint32_t space) {
     /*
         [+] /
           |_ [-] document.pdf
           |_ [+] img
                |_ [+] a
     */
+    std::string name;
+    std::vector<DirEntry_t> entries;
+
+    // the nested dirs are visited without holding the lock of this one
+    // (one removed by another thread meanwhile is left out)
+    {
+        std::shared_lock<std::shared_mutex> lock(getDirLock(dirEntry.startCluster));
+        std::shared_ptr<Dir_t> dir = loadLiveDir(dirEntry.startCluster, dirEntry.generation);
+        if (dir == nullptr)
+            return;
+        name = dir->header.name;
+        entries = dir->entries;
+        for (auto &entry : entries)
+            setGenerations(entry, dirEntry.generation);
+    }
     if (space == 0)
-        std::cout << "[+] " << dir->header.name << "\n";
+        std::cout << "[+] " << name << "\n";
 
-    for (uint32_t i = 0; i < dir->header.entryCount; i++) {
-        for (int j = 0; j < space + 2; j++)
+    for (auto &entry : entries) {
+        for (uint32_t j = 0; j < space + 2; j++)
             std::cout << " ";
         std::cout << "|_ ";
-        if (dir->entries[i].directory == false) {
-            std::cout << "[-] " << dir->entries[i].name << "\n";
+        if (entry.directory == false) {
+            std::cout << "[-] " << entry.name << "\n";
         } else {
-            std::cout << "[+] " << dir->entries[i].name << "\n";
-            Dir_t *nestedDir = loadDir(dir->entries[i].startCluster);
-            printTree(nestedDir, space + 5);
-            delete nestedDir;
+            std::cout << "[+] " << entry.name << "\n";
+            printTree(entry, space + 5);
         }
     }
-}
\ No newline at end of file
+}
+
+// the geometries FAT32::mount() has an engine for, any other one uses the generic engine
+template class FAT32Engine<FAT32::DEFAULT_CLUSTER_SIZE, FAT32::DEFAULT_MAX_NAME_LEN>;
+template class FAT32Engine<512, FAT32::DEFAULT_MAX_NAME_LEN>;
+template class FAT32Engine<KB(4), FAT32::DEFAULT_MAX_NAME_LEN>;
+template class FAT32Engine<KB(64), FAT32::DEFAULT_MAX_NAME_LEN>;
+template class FAT32Engine<0, 0>;
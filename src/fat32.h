@@ -1,30 +1,74 @@
 #ifndef _FAT32_H_
 #define _FAT32_H_
 
+#include <array>
+#include <mutex>
+#include <atomic>
 #include <climits>
+#include <condition_variable>
 #include <cstdint>
-#include <array>
+#include <string>
+#include <memory>
+#include <vector>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-#include "fs.h"
 #include "diskdriver.h"
+#include "lrucache.h"
+#include "pagedtable.h"
 
 #define KB(x) ((x) * (1 << 10))
 #define MB(x) ((x) * (1 << 20))
-#define GB(x) ((x) * (1 << 30))
+#define GB(x) ((x) * (1ULL << 30))
 
-class FAT32 : public IFS {
+// the file system itself - the geometry (cluster size, max name length) is read from
+// the disk's superblock and it's used through a Session which holds the working dir
+// the relative paths are resolved against
+//
+// this is the part that doesn't depend on the geometry (constants, the superblock, the
+// interface), the work is done by FAT32Engine compiled for the geometry of the disk
+class FAT32 {
 public:
-    static constexpr uint32_t MAX_NAME_LEN = 16;
-    static constexpr uint32_t LS_SPACING = MAX_NAME_LEN - 1;
+    static constexpr uint32_t LS_SPACING = 15;
     static constexpr const char *DISK_FILE_NAME  = "disk.dat";
 
-    static constexpr uint32_t DISK_SIZE    = MB(50);
-    static constexpr uint32_t CLUSTER_SIZE = 128;
+    // the geometry used when a new disk is created without being told otherwise
+    static constexpr uint64_t DEFAULT_DISK_SIZE    = MB(50);
+    static constexpr uint32_t DEFAULT_CLUSTER_SIZE = 128;
+    static constexpr uint32_t DEFAULT_MAX_NAME_LEN = 16;
+    static constexpr uint32_t MAX_NAME_LEN_LIMIT   = 255;
+
     static constexpr uint8_t ADDR_SIZE = sizeof(uint32_t);
+    static constexpr uint8_t SHARE_COUNT_SIZE = sizeof(uint16_t);
+
+    // the very end of the disk is reserved for the superblock
+    static constexpr uint32_t SUPERBLOCK_SIZE = 64;
+    static constexpr uint32_t FS_MAGIC = 0x33544146; // "FAT3"
+
+    // 0 - the FAT is followed right by the clusters (no share table, no superblock)
+    // 1 - every chain ends with an extra cluster holding EOF_CLUSTER (no superblock)
+    // 2 - the last cluster of a chain holds EOF_CLUSTER itself
+    // 3 - the superblock holds the geometry of the disk
+    // 4 - 64-bit disk and file sizes
+    // 5 - the superblock holds a summary of the free clusters
+    static constexpr uint32_t FS_VERSION = 5;
 
-    static constexpr uint32_t CLUSTER_COUNT = DISK_SIZE / (ADDR_SIZE + CLUSTER_SIZE);
+    // the summary is valid only if the disk has been synced after its last change
+    // (it's marked dirty by the first change after mounting or syncing the disk)
+    static constexpr uint32_t FS_STATE_DIRTY = 0;
+    static constexpr uint32_t FS_STATE_CLEAN = 1;
+
+    // the FAT is followed by a table telling how many other files share each cluster
     static constexpr uint32_t FAT_TABLE_START_ADDR = 0;
-    static constexpr uint32_t CLUSTERS_START_ADDR = FAT_TABLE_START_ADDR + (CLUSTER_COUNT * ADDR_SIZE);
+
+    // both tables are read in page by page as they're used and only
+    // up to TABLE_CACHE_PAGES pages of each are kept in memory by default
+    static constexpr uint32_t FAT_PAGE_SIZE = KB(4);
+    static constexpr uint32_t FAT_PAGE_ENTRIES = FAT_PAGE_SIZE / ADDR_SIZE;
+    static constexpr uint32_t TABLE_CACHE_PAGES = 4096;
+    static constexpr uint16_t MAX_SHARE_COUNT = UINT16_MAX;
 
     static constexpr uint32_t FREE_CLUSTER  = (1L << 32) - 1;
     static constexpr uint32_t EOF_CLUSTER   = (1L << 32) - 2;
@@ -32,91 +76,429 @@ public:
     static constexpr uint32_t ALL_CLUSTERS_TAKEN = (1L << 32) - 4;
 
     static constexpr uint32_t ROOT_DIR_CLUSTER_INDEX = 0;
+    static constexpr uint32_t DIR_INDEX_THRESHOLD = 32;
+    static constexpr uint32_t DIR_CACHE_SIZE = 256;
+    static constexpr uint32_t IMPORT_CHUNK_SIZE = MB(4);
+
+    // files imported or exported together are spread over a pool of worker threads
+    // shared by all mounts (at least this many, otherwise one per core)
+    static constexpr uint32_t MIN_TRANSFER_THREADS = 2;
+    static constexpr uint32_t TRANSFER_PIPELINE_DEPTH = 64; // max files being transferred at once
+
+    // dirs are locked by their start cluster, several of them share one lock
+    static constexpr uint32_t DIR_LOCK_STRIPES = 64;
+
+    // every thread allocates small chains from its own slot of clusters reserved
+    // in advance (threads beyond ALLOC_SLOTS share the slots)
+    static constexpr uint32_t ALLOC_SLOTS = 16;
+    static constexpr uint32_t RESERVATION_SIZE = 256;
+
+    // on the disk, the name takes up exactly maxNameLen bytes
+    // (padded with zeros) and the rest of the fields follow
+    static constexpr uint32_t DIR_ENTRY_FIELDS_SIZE = 2 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(bool);
+    static constexpr uint32_t LEGACY_DIR_ENTRY_FIELDS_SIZE = 3 * sizeof(uint32_t) + sizeof(bool);
+    static constexpr uint32_t DIR_HEADER_FIELDS_SIZE = 3 * sizeof(uint32_t);
+
+    struct Geometry_t {
+        uint64_t diskSize;
+        uint32_t clusterSize;
+        uint32_t maxNameLen;
+    };
+
+    static constexpr Geometry_t DEFAULT_GEOMETRY = {DEFAULT_DISK_SIZE, DEFAULT_CLUSTER_SIZE, DEFAULT_MAX_NAME_LEN};
 
     struct DirEntry_t {
-        char name[MAX_NAME_LEN];
-        uint32_t startCluster;
-        uint32_t parentStartCluster;
-        uint32_t size;
-        bool directory;
-        bool operator==(const DirEntry_t other) const;
-        bool operator!=(const DirEntry_t other) const;
-    } __attribute__((packed));
+        std::string name;
+        uint32_t startCluster = 0;
+        uint32_t parentStartCluster = 0;
+        uint64_t size = 0;
+        bool directory = false;
+
+        // which of the dirs that have started at startCluster (and at parentStartCluster)
+        // since the mount the entry belongs to - kept only in memory, see dirGenerations
+        uint32_t generation = 0;
+        uint32_t parentGeneration = 0;
+
+        // only the fields stored on the disk are compared
+        bool operator==(const DirEntry_t &other) const;
+        bool operator!=(const DirEntry_t &other) const;
+    };
 
     struct DirHeader_t {
-        char name[MAX_NAME_LEN];
+        std::string name;
         uint32_t startCluster;
         uint32_t parentStartCluster;
         uint32_t entryCount;
+    };
+
+    struct Superblock_t {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t clusterSize;
+        uint32_t maxNameLen;
+        uint32_t clusterCount;
+        uint64_t diskSize;
+        uint32_t state;
+        uint32_t freeClusters;
+        uint32_t sharedClusters;
+        uint32_t nextFreeCluster;
     } __attribute__((packed));
 
-    struct Dir_t {
-        DirHeader_t header;
-        DirEntry_t *entries;
-        ~Dir_t();
+    // the superblock of version 3 disks (limited to 4 GB)
+    struct LegacySuperblock_t {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t diskSize;
+        uint32_t clusterSize;
+        uint32_t maxNameLen;
+        uint32_t clusterCount;
     } __attribute__((packed));
 
+    // held by shared pointers so a dir changed in a transaction can be kept in memory
+    struct Dir_t : std::enable_shared_from_this<Dir_t> {
+        DirHeader_t header;
+        std::vector<DirEntry_t> entries;
+
+        // the dir's chain of clusters, kept in step with the FAT
+        // so the entries are found without walking it
+        std::vector<uint32_t> clusters;
+
+        // name -> position in entries, built once the dir gets large
+        std::unordered_map<std::string, uint32_t> index;
+        bool indexed = false;
+    };
+
+    // a run of consecutive clusters
+    struct Extent_t {
+        uint32_t start;
+        uint32_t count;
+    };
+
     DirEntry_t NULL_DIR_ENTRY;
 
-    static constexpr uint32_t ENTRIES_IN_ONE_CLUSTER = CLUSTER_SIZE / sizeof(DirEntry_t);
-    static constexpr uint32_t ENTRIES_IN_CLUSTER_AFTER_DIR_HEADER = (CLUSTER_SIZE - sizeof(DirHeader_t)) / sizeof(DirEntry_t);
+    static_assert(sizeof(Superblock_t) <= SUPERBLOCK_SIZE, "superblock is too large");
 
 private:
-    IDiskDriver *disk;
-    std::array<uint32_t, CLUSTER_COUNT> fat;
-    uint32_t workingDirStartCluster;
-    
-    static FAT32 *instance;
+    friend class MountTable;
 
-private:
-    FAT32();
+    // opens the disk image at the given path (creating it with the given geometry if it doesn't
+    // exist) keeping up to the given number of pages of the FAT and the share table in memory,
+    // images are opened through a MountTable so each of them is mounted only once - the engine
+    // compiled for the disk's geometry is used if there's one (unless the generic one is asked for)
+    static FAT32 *mount(const std::string &path, IDiskDriver *disk, const Geometry_t &geometry, uint32_t tableCachePages, bool specialized);
+
+protected:
+    FAT32() = default;
     FAT32(FAT32 &) = delete;
     void operator=(FAT32 &) = delete;
 
-    void initialize();
+    static uint64_t countClusters(const Geometry_t &geometry);
+    static uint64_t countLegacyClusters(const Geometry_t &geometry);
+    static bool isRootDirAt(IDiskDriver *disk, uint64_t addr);
+    static uint32_t readSuperblock(IDiskDriver *disk, Geometry_t &geometry);
+
+public:
+    virtual ~FAT32() = default;
+
+    // the cluster size must be a power of two large enough to hold a dir header or entry
+    // and the disk must hold at least one cluster but no more than the FAT can address
+    static bool isValidGeometry(const Geometry_t &geometry);
+
+    // relative paths are resolved against the given working dir (the entry of a dir
+    // returned by getRootDir or cd), in, out and cat return the number of bytes transferred
+    virtual DirEntry_t getRootDir() = 0;
+    virtual void mkdir(const DirEntry_t &workingDir, std::string name) = 0;
+    virtual void ls(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual DirEntry_t cd(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual void rmdir(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual uint64_t in(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual uint64_t out(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual uint64_t cat(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual uint64_t in(const DirEntry_t &workingDir, const std::vector<std::string> &paths) = 0;
+    virtual uint64_t out(const DirEntry_t &workingDir, const std::vector<std::string> &patterns) = 0;
+    virtual uint64_t inDir(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual uint64_t outDir(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual void rm(const DirEntry_t &workingDir, std::string path) = 0;
+    virtual void cp(const DirEntry_t &workingDir, std::string des, std::string src, bool reflink) = 0;
+    virtual void mv(const DirEntry_t &workingDir, std::string des, std::string src) = 0;
+    virtual std::string getPWD(const DirEntry_t &workingDir) = 0;
+    virtual void tree(const DirEntry_t &workingDir, std::string path) = 0;
+
+    virtual void info() = 0;
+
+    // flush writes out the changes made so far, sync also makes them durable
+    // and marks the summary of the free clusters in the superblock as up to date
+    virtual void flush() = 0;
+    virtual void sync() = 0;
+
+    // changes made between begin and commit are held back until the commit - a transaction
+    // can be begun only by the one session bound to the file system (begin fails otherwise)
+    // and a session being bound while it's open waits for its commit (unless it's being
+    // bound by the thread that has begun the transaction, which is a bug)
+    virtual bool begin() = 0;
+    virtual void commit() = 0;
+
+    // every session is bound to the file system for its whole life (see session.h)
+    virtual void attachSession() = 0;
+    virtual void detachSession() = 0;
+};
+
+// does the actual work - a non-zero CLUSTER_SIZE or MAX_NAME_LEN replaces the field of the
+// geometry, so all the arithmetic derived from it is folded into constants (see FAT32::mount()
+// for the geometries it's compiled for, any other one is served by FAT32Engine<0, 0>)
+//
+// it can be used from several threads at once:
+//  - operations changing the file system hold syncMutex shared, sync() holds it exclusively
+//  - a dir is read under its lock held shared and changed under it held exclusively
+//  - the allocator and the free map are guarded by allocMutex (taken rarely thanks to
+//    the reservations) and changes of the share counts by shareMutex
+//  - the file system has no working dir of its own, every thread uses a Session
+//    holding one and passes it in explicitly (see session.h)
+template<uint32_t CLUSTER_SIZE, uint32_t MAX_NAME_LEN>
+class FAT32Engine final : public FAT32 {
+private:
+    // free clusters set aside for the threads using one allocation slot
+    struct Reservation_t {
+        std::mutex mutex;
+        std::vector<Extent_t> extents;
+        uint32_t count = 0;
+    };
+
+    // a file whose data has been written but which is not in any dir yet
+    struct ImportedFile_t {
+        std::string name;
+        uint64_t size;
+        uint32_t startCluster;
+    };
+
+    // a file on the host to be imported into a dir
+    struct ImportJob_t {
+        std::string path;
+        DirEntry_t dir;
+    };
+
+    // a file to be exported onto the host
+    struct ExportJob_t {
+        DirEntry_t entry;
+        std::string path;
+    };
+
+    IDiskDriver *disk;
+    std::string path;
+
+    // the layout of the disk - all of it is derived from its geometry
+    Geometry_t geometry;
+    uint32_t clusterCount;
+    uint64_t shareTableStartAddr;
+    uint64_t clustersStartAddr;
+    uint64_t superblockAddr;
+
+    uint32_t tableCachePages;
+    PagedTable<uint32_t, FAT_PAGE_SIZE> fat;
+
+    // number of files sharing a cluster besides its first owner (reflinks)
+    PagedTable<uint16_t, FAT_PAGE_SIZE> shares;
+    std::atomic<uint32_t> sharedClusters;
+    std::mutex shareMutex;
+
+    // parsed directories, keyed by their start cluster
+    LRUCache<uint32_t, std::shared_ptr<Dir_t>> dirCache;
+    std::mutex dirCacheMutex;
+    std::array<std::shared_mutex, DIR_LOCK_STRIPES> dirLocks;
+    std::shared_mutex syncMutex;
+
+    // the number of dirs removed from each cluster since the mount (guarded by dirCacheMutex)
+    // - a dir is told apart from the ones started at the same cluster before it by this
+    // generation, so whoever looked it up before it was removed finds out it's gone
+    // even if its cluster has been handed out again since
+    std::unordered_map<uint32_t, uint32_t> dirGenerations;
+
+    // summary of the whole disk kept in the superblock (as of the last sync)
+    std::atomic<uint32_t> freeClusters;
+    std::atomic<bool> summaryDirty;
+    std::mutex summaryMutex;
+
+    // in-memory index of free clusters (bit i is set <=> cluster i is free and
+    // not reserved) covering only the pages of the FAT that have been scanned so far
+    std::vector<uint64_t> freeMap;
+    uint32_t mappedFreeClusters;
+    uint32_t freeHint;
+    std::mutex allocMutex;
+    std::array<Reservation_t, ALLOC_SLOTS> reservations;
+
+    // while a transaction is open, the changed dirs (guarded by dirCacheMutex) and the
+    // changed pages of the tables are kept in memory and the freed clusters are not reused
+    // (guarded by allocMutex) until it's committed, so the disk keeps the state as of the
+    // last commit - only the clusters allocated in the transaction itself can be reused
+    std::atomic<bool> transactionOpen;
+
+    // the sessions bound to the file system (guarded by sessionMutex) - a transaction is open
+    // only while its session is the only one, so nobody else's changes are held back
+    uint32_t sessionCount;
+    std::mutex sessionMutex;
+    std::condition_variable transactionCommitted;
+
+    // the thread that has begun the open transaction (guarded by sessionMutex) - it
+    // would wait for its own commit forever if it bound another session meanwhile
+    std::thread::id transactionOwner;
+    std::unordered_map<uint32_t, std::shared_ptr<Dir_t>> dirtyDirs;
+    std::unordered_set<uint32_t> heldClusters;
+    std::unordered_set<uint32_t> newClusters;
+
+    friend class FAT32;
+
+private:
+    FAT32Engine(const std::string &path, IDiskDriver *disk, const Geometry_t &geometry, uint32_t tableCachePages);
+    FAT32Engine(FAT32Engine &) = delete;
+    void operator=(FAT32Engine &) = delete;
+
+    inline uint32_t getClusterSize() const {
+        if constexpr (CLUSTER_SIZE != 0)
+            return CLUSTER_SIZE;
+        return geometry.clusterSize;
+    }
+
+    inline uint32_t getMaxNameLen() const {
+        if constexpr (MAX_NAME_LEN != 0)
+            return MAX_NAME_LEN;
+        return geometry.maxNameLen;
+    }
+
+    inline uint32_t getDirEntrySize() const {
+        return getMaxNameLen() + DIR_ENTRY_FIELDS_SIZE;
+    }
+
+    inline uint32_t getDirHeaderSize() const {
+        return getMaxNameLen() + DIR_HEADER_FIELDS_SIZE;
+    }
+
+    inline uint32_t getEntriesInOneCluster() const {
+        return getClusterSize() / getDirEntrySize();
+    }
+
+    inline uint32_t getEntriesInClusterAfterDirHeader() const {
+        return (getClusterSize() - getDirHeaderSize()) / getDirEntrySize();
+    }
+
+    inline uint32_t getDirClustersNeeded(uint32_t entryCount) const {
+        uint32_t otherEntries = entryCount - std::min(entryCount, getEntriesInClusterAfterDirHeader());
+        return 1 + (otherEntries + getEntriesInOneCluster() - 1) / getEntriesInOneCluster();
+    }
+
+    void setGeometry(const Geometry_t &geometry);
+    void initialize(const Geometry_t &geometry);
     void load();
+    void saveSuperblock(uint32_t state);
+    bool loadSummary();
+    void recountClusters();
+    inline void markSummaryDirty();
+    void migrateShareTable();
+    void migrateEofClusters();
+    void migrateDirEntries();
     inline void saveFat();
-    inline void loadFat();
+    void saveChanges(bool durable);
+    bool deferDirWrite(Dir_t *dir);
+    void saveDirtyDirs();
+    void releaseHeldClusters();
+    void serializeDirEntry(const DirEntry_t &entry, char *data) const;
+    void deserializeDirEntry(DirEntry_t &entry, const char *data) const;
+    void serializeDirHeader(const DirHeader_t &header, char *data) const;
+    void deserializeDirHeader(DirHeader_t &header, const char *data) const;
+    void saveDirHeader(Dir_t *dir);
+    void saveDirEntry(Dir_t *dir, uint32_t index);
     void saveDir(Dir_t *dir);
-    void saveDirFirstCluster(Dir_t *dir, uint32_t entryCount);
-    Dir_t *loadDir(uint32_t startCluster);
+    uint64_t getDirEntryAddr(Dir_t *dir, uint32_t index);
+    std::shared_ptr<Dir_t> loadDir(uint32_t startCluster);
+    std::shared_ptr<Dir_t> loadLiveDir(uint32_t startCluster, uint32_t generation);
+    std::shared_ptr<Dir_t> loadDirOf(const DirEntry_t &entry);
+    inline std::shared_mutex &getDirLock(uint32_t startCluster);
+    uint32_t getDirGeneration(uint32_t startCluster);
+    void setGenerations(DirEntry_t &entry, uint32_t parentGeneration);
+    void retireDir(uint32_t startCluster);
+    void resetFreeMap();
+    void scanFatPage();
+    void scanForFreeClusters(uint32_t n);
+    inline bool isScanned(uint32_t index) const;
+    void setFatEntry(uint32_t index, uint32_t value);
+    void setShareCount(uint32_t index, uint16_t value);
     uint32_t getFreeCluster();
-    bool existsNumberOfFreeClusters(uint32_t n) const;
+    uint32_t findFreeRun(uint32_t from, uint32_t &length) const;
+    void markFree(const Extent_t &extent);
+    std::vector<Extent_t> takeFreeClusters(uint32_t n);
+    std::vector<Extent_t> takeReservedClusters(Reservation_t &reservation, uint32_t n);
+    void releaseReservations();
+    std::vector<Extent_t> allocateClusters(uint32_t n);
+    std::vector<Extent_t> getExtents(uint32_t startCluster, uint32_t clusterCount);
+    std::vector<IDiskDriver::IOVec_t> getIORequests(const std::vector<Extent_t> &extents, char *buffer, uint64_t size, uint64_t offset = 0);
+    inline uint32_t getClusterCount(uint64_t size) const;
     void freeAllOccupiedClusters(uint32_t startCluster);
+    void releaseFileClusters(uint32_t startCluster);
     Dir_t *createEmptyDir(std::string name, uint32_t parentStartCluster);
-    inline uint32_t clusterAddr(uint32_t index);
-    void addEntryIntoDir(Dir_t *dir, DirEntry_t *entry);
+    std::vector<DirEntry_t> createDirs(const DirEntry_t &parent, const std::vector<std::string> &names);
+    inline uint64_t clusterAddr(uint32_t index);
+    bool addEntryIntoDir(Dir_t *dir, DirEntry_t *entry);
+    void replaceEntryInDir(Dir_t *dir, DirEntry_t *prevEntry, DirEntry_t *entry);
     void removeEntryFromDir(Dir_t*dir, DirEntry_t *entry);
+    void buildDirIndex(Dir_t *dir);
+    uint32_t findEntry(Dir_t *dir, const std::string &name);
     DirEntry_t getEntry(std::string name, Dir_t *dir);
-    DirEntry_t getEntry(std::string path);
-    DirEntry_t createFileEntry(Dir_t *dir, const char *name, uint32_t size);
+    DirEntry_t getEntry(const DirEntry_t &workingDir, std::string path);
+    DirEntry_t getDirEntry(const DirEntry_t &dir);
+    DirEntry_t getParentEntry(const DirEntry_t &dir);
+    DirEntry_t lookupEntry(const DirEntry_t &dir, const std::string &name);
+    bool getParentDir(const DirEntry_t &workingDir, const std::string &path, DirEntry_t &dir);
+    bool getTarget(const DirEntry_t &workingDir, const std::string &des, const std::string &src, DirEntry_t &dir, std::string &name);
+    DirEntry_t createFileEntry(Dir_t *dir, const std::string &name, uint64_t size, uint32_t startCluster);
     DirEntry_t createEntry(Dir_t *dir);
-    inline uint32_t getFileSize(FILE *file) const;
+    inline uint64_t getFileSize(FILE *file) const;
     std::string getFileName(std::string path) const;
-    void copyClusters(uint32_t srcStartCluster, uint32_t desStartCluster);
+    void sendFile(const DirEntry_t &entry, int fd);
+    const char *checkImportedFile(const DirEntry_t &dir, const std::string &path);
+    bool importFile(const DirEntry_t &dir, const std::string &path, ImportedFile_t &imported);
+    bool addImportedFile(const DirEntry_t &dir, const ImportedFile_t &file);
+    uint64_t importFiles(const std::vector<ImportJob_t> &jobs);
+    bool exportFile(const DirEntry_t &entry, const std::string &path);
+    uint64_t exportFiles(const std::vector<ExportJob_t> &jobs);
+    std::vector<std::string> expandPath(const DirEntry_t &workingDir, const std::string &pattern);
+    uint32_t copyClusters(uint32_t srcStartCluster, uint64_t size, bool reflink);
+    uint32_t shareClusters(uint32_t startCluster, uint64_t size);
 
     void printDir(Dir_t *dir);
     void printDirEntry(DirEntry_t *entry);
     void printFAT();
-    void printTree(Dir_t *dir, uint32_t space);
+    void printTree(const DirEntry_t &dir, uint32_t space);
 
 public:
-    static FAT32 *getInstance();
-
-    void mkdir(std::string name) override;
-    void ls(std::string path) override;
-    void pwd() override;
-    void cd(std::string path) override;
-    void rmdir(std::string path) override;
-    void in(std::string path) override;
-    void out(std::string path) override;
-    void cat(std::string path) override;
-    void rm(std::string path) override;
-    void cp(std::string des, std::string src) override;
-    void mv(std::string des, std::string src) override;
-    std::string getPWD() override;
+    ~FAT32Engine() override;
+
+    DirEntry_t getRootDir() override;
+    void mkdir(const DirEntry_t &workingDir, std::string name) override;
+    void ls(const DirEntry_t &workingDir, std::string path) override;
+    DirEntry_t cd(const DirEntry_t &workingDir, std::string path) override;
+    void rmdir(const DirEntry_t &workingDir, std::string path) override;
+    uint64_t in(const DirEntry_t &workingDir, std::string path) override;
+    uint64_t out(const DirEntry_t &workingDir, std::string path) override;
+    uint64_t cat(const DirEntry_t &workingDir, std::string path) override;
+    uint64_t in(const DirEntry_t &workingDir, const std::vector<std::string> &paths) override;
+    uint64_t out(const DirEntry_t &workingDir, const std::vector<std::string> &patterns) override;
+    uint64_t inDir(const DirEntry_t &workingDir, std::string path) override;
+    uint64_t outDir(const DirEntry_t &workingDir, std::string path) override;
+    void rm(const DirEntry_t &workingDir, std::string path) override;
+    void cp(const DirEntry_t &workingDir, std::string des, std::string src, bool reflink) override;
+    void mv(const DirEntry_t &workingDir, std::string des, std::string src) override;
+    std::string getPWD(const DirEntry_t &workingDir) override;
+    void tree(const DirEntry_t &workingDir, std::string path) override;
+
     void info() override;
-    void tree(std::string path) override;
+
+    void flush() override;
+    void sync() override;
+
+    bool begin() override;
+    void commit() override;
+
+    void attachSession() override;
+    void detachSession() override;
 };
 
-#endif
\ No newline at end of file
+#endif
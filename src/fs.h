@@ -2,6 +2,7 @@
 #define _FS_H_
 
 #include <string>
+#include <vector>
 
 class IFS {
 public:
@@ -12,12 +13,31 @@ public:
     virtual void rmdir(std::string path) = 0;
     virtual void in(std::string path) = 0;
     virtual void out(std::string path) = 0;
+
+    // several files at once (exports may contain wildcards in their names)
+    virtual void in(const std::vector<std::string> &paths) = 0;
+    virtual void out(const std::vector<std::string> &paths) = 0;
+
+    // a whole tree of dirs
+    virtual void inDir(std::string path) = 0;
+    virtual void outDir(std::string path) = 0;
     virtual void cat(std::string path) = 0;
     virtual void rm(std::string path) = 0;
-    virtual void cp(std::string des, std::string src) = 0;
+    virtual void cp(std::string des, std::string src, bool reflink) = 0;
     virtual void mv(std::string des, std::string src) = 0;
     virtual std::string getPWD() = 0;
     virtual void info() = 0;
+
+    // flush writes out the changes made so far, sync also makes them durable
+    // and marks the summary of the free clusters in the superblock as up to date
+    virtual void flush() = 0;
+    virtual void sync() = 0;
+
+    // changes made between begin and commit are held back until the commit
+    // (begin fails if a transaction can't be begun right now)
+    virtual bool begin() = 0;
+    virtual void commit() = 0;
+    virtual bool inTransaction() = 0;
     virtual void tree(std::string path) = 0;
 };
 
@@ -0,0 +1,84 @@
+#ifndef _LRU_CACHE_H_
+#define _LRU_CACHE_H_
+
+#include <list>
+#include <cstdint>
+#include <utility>
+#include <unordered_map>
+
+template<typename Key, typename Value>
+class LRUCache {
+private:
+    using Item_t = std::pair<Key, Value>;
+
+    size_t capacity;
+    std::list<Item_t> items; // the most recently used item goes first
+    std::unordered_map<Key, typename std::list<Item_t>::iterator> lookup;
+    uint64_t hits;
+    uint64_t misses;
+
+public:
+    explicit LRUCache(size_t capacity) : capacity(capacity), hits(0), misses(0) {
+    }
+
+    Value *get(const Key &key) {
+        auto it = lookup.find(key);
+        if (it == lookup.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        items.splice(items.begin(), items, it->second);
+        return &it->second->second;
+    }
+
+    // looks the item up without counting it as a use
+    Value *peek(const Key &key) {
+        auto it = lookup.find(key);
+        return it == lookup.end() ? nullptr : &it->second->second;
+    }
+
+    void put(const Key &key, const Value &value) {
+        auto it = lookup.find(key);
+        if (it != lookup.end()) {
+            it->second->second = value;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+        items.emplace_front(key, value);
+        lookup[key] = items.begin();
+
+        // evict the least recently used item
+        if (items.size() > capacity) {
+            lookup.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+    void erase(const Key &key) {
+        auto it = lookup.find(key);
+        if (it == lookup.end())
+            return;
+        items.erase(it->second);
+        lookup.erase(it);
+    }
+
+    void clear() {
+        items.clear();
+        lookup.clear();
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    uint64_t getHits() const {
+        return hits;
+    }
+
+    uint64_t getMisses() const {
+        return misses;
+    }
+};
+
+#endif
@@ -1,14 +1,115 @@
+#include <bit>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
 
 #include "fat32.h"
 #include "shell.h"
+#include "session.h"
+#include "mounttable.h"
+#include "disk.h"
+#include "mmapdisk.h"
+#include "uringdisk.h"
+#include "cacheddisk.h"
+
+static void printUsage(const char *program) {
+    std::cout << "usage: " << program << " [-i image] [-d disk|mmap|uring|threads] [-c pages] [-t table pages] [-s disk size [MB]] [-b cluster size [B]] [-n max name length]\n";
+}
+
+int main(int argc, char *argv[]) {
+    std::string image = FAT32::DISK_FILE_NAME;
+    IDiskDriver *disk = nullptr;
+    uint32_t cachePages = 0;
+    uint32_t tablePages = FAT32::TABLE_CACHE_PAGES;
+    FAT32::Geometry_t geometry = FAT32::DEFAULT_GEOMETRY;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:d:c:t:s:b:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                image = optarg;
+                break;
+            case 'd':
+                // the last driver given is used, the ones before it are dropped
+                delete disk;
+                disk = nullptr;
+                if (strcmp(optarg, "disk") == 0) {
+                    disk = new Disk;
+                } else if (strcmp(optarg, "mmap") == 0) {
+                    disk = new MmapDisk;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    disk = new UringDisk;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    disk = new UringDisk(false);
+                } else {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                cachePages = atoi(optarg);
+                if (cachePages < 64) {
+                    std::cout << "the cache needs at least 64 pages\n";
+                    return 1;
+                }
+                break;
+            case 't':
+                if (atoi(optarg) <= 0) {
+                    std::cout << "the tables need at least 1 page in memory\n";
+                    return 1;
+                }
+                tablePages = atoi(optarg);
+                break;
+            // the geometry only matters when a new disk is created
+            case 's':
+                if (atoll(optarg) <= 0) {
+                    std::cout << "the disk size must be at least 1 MB\n";
+                    return 1;
+                }
+                geometry.diskSize = static_cast<uint64_t>(atoll(optarg)) * MB(1);
+                break;
+            case 'b':
+                if (atoi(optarg) <= 0 || !std::has_single_bit(static_cast<uint32_t>(atoi(optarg)))) {
+                    std::cout << "the cluster size must be a power of two\n";
+                    return 1;
+                }
+                geometry.clusterSize = atoi(optarg);
+                break;
+            case 'n':
+                if (atoi(optarg) <= 0 || atoi(optarg) > static_cast<int>(FAT32::MAX_NAME_LEN_LIMIT)) {
+                    std::cout << "the max name length must be between 1 and " << FAT32::MAX_NAME_LEN_LIMIT << "\n";
+                    return 1;
+                }
+                geometry.maxNameLen = atoi(optarg);
+                break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    // the options are checked together, since the cluster has to hold a dir entry with the longest
+    // name and the disk has to hold at least one cluster but no more than the FAT can address
+    if (!FAT32::isValidGeometry(geometry)) {
+        std::cout << "the cluster size must be at least " << geometry.maxNameLen + FAT32::DIR_ENTRY_FIELDS_SIZE
+                  << " B and the disk must have between 1 and " << FAT32::ALL_CLUSTERS_TAKEN - 1 << " clusters\n";
+        return 1;
+    }
 
-int main() {
-    assert(sizeof(FAT32::DirHeader_t) <= FAT32::CLUSTER_SIZE);
-    assert(sizeof(FAT32::DirEntry_t) <= FAT32::CLUSTER_SIZE);
+    // put the page cache in front of the chosen driver
+    if (disk == nullptr)
+        disk = new Disk;
+    if (cachePages > 0)
+        disk = new CachedDisk(disk, cachePages);
 
-    Shell::getInstance()->setFS(FAT32::getInstance());
+    // the image is closed properly once the shell is done
+    MountTable mounts;
+    Session session(mounts.mount(image, disk, geometry, tablePages));
+    Shell::getInstance()->setFS(&session);
     Shell::getInstance()->run();
 
     return 0;
-}
\ No newline at end of file
+}
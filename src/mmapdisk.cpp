@@ -0,0 +1,111 @@
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mmapdisk.h"
+
+MmapDisk::MmapDisk() : fd(-1), data(nullptr), size(0), addr(0) {
+}
+
+MmapDisk::~MmapDisk() {
+    close();
+}
+
+bool MmapDisk::diskExists(std::string name) {
+    return access(name.c_str(), R_OK | W_OK) == 0;
+}
+
+void MmapDisk::open(std::string name) {
+    fd = ::open(name.c_str(), O_RDWR);
+    assert(fd != -1 && "could not open the disk");
+
+    struct stat info;
+    int result = fstat(fd, &info);
+    assert(result == 0 && "could not get the size of the disk");
+    (void)result;
+    size = info.st_size;
+
+    // the whole disk is mapped into the memory at once
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mapping != MAP_FAILED && "could not map the disk");
+    data = static_cast<char *>(mapping);
+    addr = 0;
+}
+
+void MmapDisk::close() {
+    if (data != nullptr) {
+        munmap(data, size);
+        data = nullptr;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void MmapDisk::create(std::string name, uint64_t size) {
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1 && "disk is NULL");
+    int result = ftruncate(fd, size);
+    assert(result == 0 && "creating disk failed");
+    (void)result;
+    ::close(fd);
+}
+
+void MmapDisk::setAddr(uint64_t addr) {
+    assert(data != nullptr && "disk is null");
+    this->addr = addr;
+}
+
+void MmapDisk::write(const char *data, size_t size) {
+    assert(this->data != nullptr && "disk is NULL");
+    assert(addr + size <= this->size && "writing past the end of the disk");
+    memcpy(this->data + addr, data, size);
+    addr += size;
+}
+
+void MmapDisk::read(char *buffer, size_t size) {
+    assert(data != nullptr && "disk is NULL");
+    assert(addr + size <= this->size && "reading past the end of the disk");
+    memcpy(buffer, data + addr, size);
+    addr += size;
+}
+
+uint64_t MmapDisk::getSize() {
+    return size;
+}
+
+void MmapDisk::sync() {
+    assert(data != nullptr && "disk is NULL");
+    int result = msync(data, size, MS_SYNC);
+    assert(result == 0 && "could not sync the disk");
+    (void)result;
+}
+
+void MmapDisk::readAt(uint64_t addr, char *buffer, size_t size) {
+    assert(data != nullptr && "disk is NULL");
+    assert(addr + size <= this->size && "reading past the end of the disk");
+    memcpy(buffer, data + addr, size);
+}
+
+void MmapDisk::writeAt(uint64_t addr, const char *data, size_t size) {
+    assert(this->data != nullptr && "disk is NULL");
+    assert(addr + size <= this->size && "writing past the end of the disk");
+    memcpy(this->data + addr, data, size);
+}
+
+const char *MmapDisk::map(uint64_t addr, size_t size) {
+    assert(data != nullptr && "disk is NULL");
+    assert(addr + size <= this->size && "mapping past the end of the disk");
+    return data + addr;
+}
+
+void MmapDisk::copy(uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    assert(data != nullptr && "disk is NULL");
+    assert(desAddr + size <= this->size && srcAddr + size <= this->size && "copying past the end of the disk");
+    memcpy(data + desAddr, data + srcAddr, size);
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef _MMAP_DISK_H_
+#define _MMAP_DISK_H_
+
+#include <string>
+#include <cstdint>
+
+#include "diskdriver.h"
+
+class MmapDisk : public IDiskDriver {
+private:
+    int fd;
+    char *data;
+    size_t size;
+    uint64_t addr;
+
+public:
+    MmapDisk();
+    ~MmapDisk();
+
+    bool diskExists(std::string name) override;
+    void open(std::string name) override;
+    void close() override;
+    void create(std::string name, uint64_t size) override;
+    void setAddr(uint64_t addr) override;
+    void write(const char *data, size_t size) override;
+    void read(char *buffer, size_t size) override;
+    uint64_t getSize() override;
+    void sync() override;
+    void readAt(uint64_t addr, char *buffer, size_t size) override;
+    void writeAt(uint64_t addr, const char *data, size_t size) override;
+    const char *map(uint64_t addr, size_t size) override;
+    void copy(uint64_t desAddr, uint64_t srcAddr, size_t size) override;
+};
+
+#endif
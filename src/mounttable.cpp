@@ -0,0 +1,53 @@
+#include <cassert>
+#include <filesystem>
+
+#include "mounttable.h"
+
+std::string MountTable::normalize(const std::string &path) {
+    // symlinks are resolved as well so an image can't be mounted twice under different names
+    return std::filesystem::weakly_canonical(std::filesystem::absolute(path)).string();
+}
+
+FAT32 *MountTable::mount(const std::string &path, IDiskDriver *disk, const FAT32::Geometry_t &geometry, uint32_t tableCachePages, bool specialized) {
+    assert(disk != nullptr && "disk is NULL");
+    std::string key = normalize(path);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(mounts.find(key) == mounts.end() && "image is already mounted");
+    FAT32 *fs = FAT32::mount(key, disk, geometry, tableCachePages, specialized);
+    mounts[key].reset(fs);
+    return fs;
+}
+
+void MountTable::unmount(const std::string &path) {
+    std::unique_ptr<FAT32> fs;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = mounts.find(normalize(path));
+        assert(it != mounts.end() && "image is not mounted");
+        fs = std::move(it->second);
+        mounts.erase(it);
+    }
+    // the file system syncs and closes the disk on its way out
+    fs.reset();
+}
+
+FAT32 *MountTable::get(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = mounts.find(normalize(path));
+    return it == mounts.end() ? nullptr : it->second.get();
+}
+
+std::vector<std::string> MountTable::getPaths() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> paths;
+    for (auto &mount : mounts)
+        paths.push_back(mount.first);
+    return paths;
+}
+
+void MountTable::syncAll() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &mount : mounts)
+        mount.second->sync();
+}
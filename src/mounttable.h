@@ -0,0 +1,41 @@
+#ifndef _MOUNT_TABLE_H_
+#define _MOUNT_TABLE_H_
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fat32.h"
+#include "diskdriver.h"
+
+// disk images opened side by side in one process, each of them with its own
+// FAT, caches and disk driver - they're keyed by the canonical path of the image
+class MountTable {
+private:
+    std::map<std::string, std::unique_ptr<FAT32>> mounts;
+    std::mutex mutex;
+
+    static std::string normalize(const std::string &path);
+
+public:
+    MountTable() = default;
+    MountTable(MountTable &) = delete;
+    void operator=(MountTable &) = delete;
+
+    // the mount takes over the driver (the geometry is used only if the image doesn't exist),
+    // the generic engine is used for any geometry only if it's not to be specialized
+    FAT32 *mount(const std::string &path, IDiskDriver *disk, const FAT32::Geometry_t &geometry = FAT32::DEFAULT_GEOMETRY,
+                 uint32_t tableCachePages = FAT32::TABLE_CACHE_PAGES, bool specialized = true);
+
+    // syncs and closes the image, no session may be using it anymore
+    void unmount(const std::string &path);
+
+    // returns nullptr if the image is not mounted
+    FAT32 *get(const std::string &path);
+    std::vector<std::string> getPaths();
+    void syncAll();
+};
+
+#endif
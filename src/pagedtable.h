@@ -0,0 +1,293 @@
+#ifndef _PAGED_TABLE_H_
+#define _PAGED_TABLE_H_
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <shared_mutex>
+
+#include "diskdriver.h"
+#include "threadslot.h"
+
+// a table of entries stored on the disk which is read in page by page as it's
+// accessed - only up to a given number of pages is kept in memory at a time,
+// it can be used from several threads as long as they don't write the same entry
+template<typename T, uint32_t PAGE_SIZE>
+class PagedTable {
+public:
+    static constexpr uint32_t PAGE_ENTRIES = PAGE_SIZE / sizeof(T);
+
+private:
+    static constexpr uint32_t FILL_CHUNK_PAGES = 256;
+    static constexpr uint32_t READER_SLOTS = 16;
+
+    // a page in memory - frames are reused for other pages once they're evicted
+    struct Frame_t {
+        std::unique_ptr<T[]> entries;
+        uint32_t index; // page number in the table
+        std::atomic<bool> dirty;
+        std::atomic<bool> referenced;
+    };
+
+    IDiskDriver *disk;
+    uint64_t startAddr;
+    uint32_t entryCount;
+    size_t capacity;
+
+    // page index -> frame holding the page (nullptr if it's not in memory)
+    std::unique_ptr<std::atomic<Frame_t *>[]> pages;
+
+    // frames in memory, evicted in the clock order
+    std::vector<std::unique_ptr<Frame_t>> frames;
+    size_t hand;
+
+    // number of frames holding changes not written out yet (so a flush
+    // with nothing to write doesn't have to go through the frames)
+    std::atomic<uint32_t> dirtyFrames;
+
+    // while set, changed pages are not written out when they're evicted - the table
+    // grows past its capacity instead if there's no clean page to evict (the extra
+    // frames are freed once the pages are let go of again)
+    bool holdDirty;
+
+    // number of lock-free reads in progress, each thread counts its reads in one of the
+    // slots - a frame is freed only when none of them may be looking at it anymore
+    struct alignas(64) ReaderSlot_t {
+        std::atomic<uint32_t> count;
+    };
+    std::array<ReaderSlot_t, READER_SLOTS> readers;
+
+    // entries are read without any locking - a read is only valid if no page
+    // has been brought in or evicted meanwhile (the version is odd while it is),
+    // writes hold the mutex shared and pages are swapped with it held exclusively
+    std::atomic<uint64_t> version;
+    mutable std::shared_mutex mutex;
+
+public:
+    PagedTable() : disk(nullptr), startAddr(0), entryCount(0), capacity(0), hand(0), dirtyFrames(0), holdDirty(false), version(0) {
+    }
+
+    PagedTable(PagedTable &) = delete;
+    void operator=(PagedTable &) = delete;
+
+    // drops all the pages in memory without writing them out
+    void init(IDiskDriver *disk, uint64_t startAddr, uint32_t entryCount, size_t capacity) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        assert(capacity > 0 && "the table needs at least one page");
+        beginSwap();
+        this->disk = disk;
+        this->startAddr = startAddr;
+        this->entryCount = entryCount;
+        this->capacity = capacity;
+        size_t pageCount = (static_cast<uint64_t>(entryCount) + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
+        pages.reset(new std::atomic<Frame_t *>[pageCount]);
+        for (size_t i = 0; i < pageCount; i++)
+            pages[i].store(nullptr, std::memory_order_relaxed);
+        frames.clear();
+        hand = 0;
+        dirtyFrames = 0;
+        endSwap();
+    }
+
+    inline T operator[](uint32_t index) {
+        assert(index < entryCount && "index out of range");
+        std::atomic<uint32_t> &reads = readers[getThreadSlot() % READER_SLOTS].count;
+        reads.fetch_add(1, std::memory_order_seq_cst);
+        uint64_t before = version.load(std::memory_order_seq_cst);
+        if ((before & 1) == 0) {
+            Frame_t *frame = pages[index / PAGE_ENTRIES].load(std::memory_order_acquire);
+            if (frame != nullptr) {
+                T value = entry(frame, index).load(std::memory_order_relaxed);
+                touch(frame);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before) {
+                    reads.fetch_sub(1, std::memory_order_release);
+                    return value;
+                }
+            }
+        }
+        reads.fetch_sub(1, std::memory_order_release);
+
+        // the page has to be brought in (or was being swapped)
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return entry(getFrame(index), index).load(std::memory_order_relaxed);
+    }
+
+    inline void set(uint32_t index, T value) {
+        assert(index < entryCount && "index out of range");
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        Frame_t *frame = pages[index / PAGE_ENTRIES].load(std::memory_order_relaxed);
+        if (frame == nullptr) {
+            lock.unlock();
+            std::unique_lock<std::shared_mutex> pageInLock(mutex);
+            write(getFrame(index), index, value);
+            return;
+        }
+        touch(frame);
+        write(frame, index, value);
+    }
+
+    // writes the value into every entry of the table on the disk
+    void fill(T value) {
+        init(disk, startAddr, entryCount, capacity);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::vector<T> buffer(std::min<uint64_t>(entryCount, FILL_CHUNK_PAGES * PAGE_ENTRIES), value);
+        for (uint64_t done = 0; done < entryCount; done += buffer.size()) {
+            size_t count = std::min<uint64_t>(buffer.size(), entryCount - done);
+            disk->writeAt(startAddr + done * sizeof(T), reinterpret_cast<const char *>(buffer.data()), count * sizeof(T));
+        }
+    }
+
+    // writes out the pages that have changed in one batch
+    void flush() {
+        if (dirtyFrames.load(std::memory_order_acquire) == 0)
+            return;
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::vector<Frame_t *> changed;
+        for (auto &frame : frames)
+            if (frame->dirty)
+                changed.push_back(frame.get());
+
+        // in ascending order so consecutive pages are merged into a single write
+        std::sort(changed.begin(), changed.end(), [](const Frame_t *a, const Frame_t *b) {
+            return a->index < b->index;
+        });
+        std::vector<IDiskDriver::IOVec_t> requests;
+        for (auto frame : changed) {
+            requests.push_back(getIORequest(frame));
+            frame->dirty = false;
+        }
+        dirtyFrames = 0;
+        if (!requests.empty())
+            disk->writev(requests);
+    }
+
+    // keeps the changed pages in memory until they're flushed (e.g. during a transaction),
+    // once they're let go of the pages held past the capacity must have been flushed
+    void setHoldDirty(bool hold) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        holdDirty = hold;
+        if (!hold && frames.size() > capacity)
+            shrink();
+    }
+
+    size_t getResidentPages() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return frames.size();
+    }
+
+private:
+    static inline std::atomic_ref<T> entry(Frame_t *frame, uint32_t index) {
+        return std::atomic_ref<T>(frame->entries[index % PAGE_ENTRIES]);
+    }
+
+    static inline void touch(Frame_t *frame) {
+        // the flag is written only when it changes to keep the cache line clean
+        if (!frame->referenced.load(std::memory_order_relaxed))
+            frame->referenced.store(true, std::memory_order_relaxed);
+    }
+
+    inline void write(Frame_t *frame, uint32_t index, T value) {
+        entry(frame, index).store(value, std::memory_order_relaxed);
+        if (!frame->dirty.load(std::memory_order_relaxed) && !frame->dirty.exchange(true, std::memory_order_acq_rel))
+            dirtyFrames.fetch_add(1, std::memory_order_release);
+    }
+
+    inline void beginSwap() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void endSwap() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // frees the frames past the capacity (the exclusive lock must be held)
+    void shrink() {
+        beginSwap();
+        for (size_t i = capacity; i < frames.size(); i++) {
+            assert(!frames[i]->dirty && "the page has not been flushed");
+            pages[frames[i]->index].store(nullptr, std::memory_order_relaxed);
+        }
+        endSwap();
+
+        // the readers that start from now on see the frames are gone, the ones
+        // that may have got hold of them before are waited for
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto &slot : readers)
+            while (slot.count.load(std::memory_order_acquire) != 0)
+                std::this_thread::yield();
+
+        frames.resize(capacity);
+        hand %= capacity;
+    }
+
+    // brings the page in if needed (the exclusive lock must be held)
+    inline Frame_t *getFrame(uint32_t index) {
+        Frame_t *frame = pages[index / PAGE_ENTRIES].load(std::memory_order_relaxed);
+        if (frame == nullptr) {
+            beginSwap();
+            frame = loadPage(index / PAGE_ENTRIES);
+            endSwap();
+        }
+        frame->referenced = true;
+        return frame;
+    }
+
+    IDiskDriver::IOVec_t getIORequest(Frame_t *frame) {
+        // the last page may be cut short by the end of the table
+        uint64_t firstEntry = static_cast<uint64_t>(frame->index) * PAGE_ENTRIES;
+        size_t count = std::min<uint64_t>(PAGE_ENTRIES, entryCount - firstEntry);
+        return {startAddr + firstEntry * sizeof(T), reinterpret_cast<char *>(frame->entries.get()), count * sizeof(T)};
+    }
+
+    // picks the page to evict, or nullptr if all of them are held in memory
+    Frame_t *findVictim() {
+        // the clock goes around skipping (and clearing) recently used pages,
+        // two rounds are enough to get back to a page whose flag was cleared
+        for (size_t step = 0; step < 2 * frames.size(); step++) {
+            Frame_t *frame = frames[hand].get();
+            hand = (hand + 1) % frames.size();
+            if (frame->referenced)
+                frame->referenced = false;
+            else if (!holdDirty || !frame->dirty)
+                return frame;
+        }
+        return nullptr;
+    }
+
+    Frame_t *loadPage(uint32_t index) {
+        Frame_t *frame;
+
+        Frame_t *victim = frames.size() < capacity ? nullptr : findVictim();
+        if (victim == nullptr) {
+            frames.emplace_back(new Frame_t);
+            frame = frames.back().get();
+            frame->entries.reset(new T[PAGE_ENTRIES]);
+        } else {
+            frame = victim;
+            if (frame->dirty) {
+                IDiskDriver::IOVec_t request = getIORequest(frame);
+                disk->writeAt(request.addr, request.buffer, request.size);
+                dirtyFrames--;
+            }
+            pages[frame->index].store(nullptr, std::memory_order_relaxed);
+        }
+
+        frame->index = index;
+        IDiskDriver::IOVec_t request = getIORequest(frame);
+        disk->readAt(request.addr, request.buffer, request.size);
+        frame->dirty = false;
+        frame->referenced = true;
+        pages[index].store(frame, std::memory_order_release);
+        return frame;
+    }
+};
+
+#endif
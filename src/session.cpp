@@ -0,0 +1,145 @@
+#include <cassert>
+#include <iostream>
+
+#include "session.h"
+
+Session::Session(FAT32 *fs) : fs(fs), transactionBegun(false) {
+    assert(fs != nullptr && "fs is NULL");
+    fs->attachSession();
+    workingDir = fs->getRootDir();
+}
+
+Session::~Session() {
+    // a transaction left open would keep other sessions from being bound
+    if (transactionBegun)
+        fs->commit();
+    fs->detachSession();
+}
+
+FAT32 *Session::getFS() const {
+    return fs;
+}
+
+const Session::Stats_t &Session::getStats() const {
+    return stats;
+}
+
+void Session::mkdir(std::string name) {
+    stats.commands++;
+    fs->mkdir(workingDir, name);
+}
+
+void Session::ls(std::string path) {
+    stats.commands++;
+    fs->ls(workingDir, path);
+}
+
+void Session::pwd() {
+    stats.commands++;
+    std::cout << fs->getPWD(workingDir) << "\n";
+}
+
+void Session::cd(std::string path) {
+    stats.commands++;
+    workingDir = fs->cd(workingDir, path);
+}
+
+void Session::rmdir(std::string path) {
+    stats.commands++;
+    fs->rmdir(workingDir, path);
+}
+
+void Session::in(std::string path) {
+    stats.commands++;
+    stats.bytesIn += fs->in(workingDir, path);
+}
+
+void Session::out(std::string path) {
+    stats.commands++;
+    stats.bytesOut += fs->out(workingDir, path);
+}
+
+void Session::cat(std::string path) {
+    stats.commands++;
+    stats.bytesOut += fs->cat(workingDir, path);
+}
+
+void Session::in(const std::vector<std::string> &paths) {
+    stats.commands++;
+    stats.bytesIn += fs->in(workingDir, paths);
+}
+
+void Session::out(const std::vector<std::string> &paths) {
+    stats.commands++;
+    stats.bytesOut += fs->out(workingDir, paths);
+}
+
+void Session::inDir(std::string path) {
+    stats.commands++;
+    stats.bytesIn += fs->inDir(workingDir, path);
+}
+
+void Session::outDir(std::string path) {
+    stats.commands++;
+    stats.bytesOut += fs->outDir(workingDir, path);
+}
+
+void Session::rm(std::string path) {
+    stats.commands++;
+    fs->rm(workingDir, path);
+}
+
+void Session::cp(std::string des, std::string src, bool reflink) {
+    stats.commands++;
+    fs->cp(workingDir, des, src, reflink);
+}
+
+void Session::mv(std::string des, std::string src) {
+    stats.commands++;
+    fs->mv(workingDir, des, src);
+}
+
+std::string Session::getPWD() {
+    return fs->getPWD(workingDir);
+}
+
+void Session::info() {
+    stats.commands++;
+    fs->info();
+    std::cout << "session commands : " << stats.commands << '\n';
+    std::cout << "session in   [B] : " << stats.bytesIn << '\n';
+    std::cout << "session out  [B] : " << stats.bytesOut << '\n';
+}
+
+void Session::flush() {
+    fs->flush();
+}
+
+void Session::sync() {
+    fs->sync();
+}
+
+bool Session::begin() {
+    stats.commands++;
+    if (transactionBegun || fs->begin() == false)
+        return false;
+    transactionBegun = true;
+    return true;
+}
+
+void Session::commit() {
+    stats.commands++;
+    if (transactionBegun == false)
+        return;
+    fs->commit();
+    transactionBegun = false;
+}
+
+bool Session::inTransaction() {
+    return transactionBegun;
+}
+
+void Session::tree(std::string path) {
+    stats.commands++;
+    fs->tree(workingDir, path);
+}
@@ -0,0 +1,64 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "fs.h"
+#include "fat32.h"
+
+// a lightweight view of a mounted file system with its own working dir and
+// statistics - any number of sessions can be bound to the same mount, but
+// each of them is meant to be used by one thread at a time (a session being
+// bound while another one has a transaction open waits for its commit, so the
+// thread that has begun it must not bind another one before committing it)
+class Session : public IFS {
+public:
+    struct Stats_t {
+        uint64_t commands = 0;
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+    };
+
+private:
+    FAT32 *fs;
+    FAT32::DirEntry_t workingDir;
+    Stats_t stats;
+
+    // a session commits only the transaction it has begun itself
+    bool transactionBegun;
+
+public:
+    explicit Session(FAT32 *fs);
+    ~Session();
+
+    FAT32 *getFS() const;
+    const Stats_t &getStats() const;
+
+    void mkdir(std::string name) override;
+    void ls(std::string path) override;
+    void pwd() override;
+    void cd(std::string path) override;
+    void rmdir(std::string path) override;
+    void in(std::string path) override;
+    void out(std::string path) override;
+    void cat(std::string path) override;
+    void in(const std::vector<std::string> &paths) override;
+    void out(const std::vector<std::string> &paths) override;
+    void inDir(std::string path) override;
+    void outDir(std::string path) override;
+    void rm(std::string path) override;
+    void cp(std::string des, std::string src, bool reflink) override;
+    void mv(std::string des, std::string src) override;
+    std::string getPWD() override;
+    void info() override;
+    void flush() override;
+    void sync() override;
+    bool begin() override;
+    void commit() override;
+    bool inTransaction() override;
+    void tree(std::string path) override;
+};
+
+#endif
@@ -3,6 +3,8 @@
 #include <sstream>
 #include <fstream>
 
+#include <glob.h>
+
 #include "shell.h"
 
 Shell *Shell::instance = nullptr;
@@ -38,6 +40,18 @@ std::vector<std::string> Shell::split(std::string str, char separator) {
     return move(tokens);
 }
 
+std::vector<std::string> Shell::expandHostPaths(const std::vector<std::string> &patterns) {
+    std::vector<std::string> paths;
+    for (auto &pattern : patterns) {
+        glob_t matches;
+        // a pattern with no matches is passed on as it is
+        if (::glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &matches) == 0)
+            paths.insert(paths.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+        globfree(&matches);
+    }
+    return paths;
+}
+
 void Shell::run() {
     std::string line;
     std::vector<std::string> args;
@@ -70,12 +84,25 @@ void Shell::loadCommands(std::string path) {
         std::cout << "file not found\n";
         return;
     }
+    // the whole script is run as one transaction unless one is already open
+    bool autoCommit = false;
+    if (fs->inTransaction() == false) {
+        autoCommit = fs->begin();
+        if (autoCommit == false)
+            std::cout << "the disk is used by other sessions, the script is run without a transaction\n";
+    }
+
     std::vector<std::string> args;
     while (std::getline(infile, line)) {
         std::cout << line << "\n";
         args = split(line, ' ');
+        if (args.empty())
+            continue;
         execute(args);
     }
+
+    if (autoCommit && fs->inTransaction())
+        fs->commit();
 }
 
 void Shell::execute(std::vector<std::string> &args) {
@@ -106,16 +133,41 @@ void Shell::execute(std::vector<std::string> &args) {
             fs->rmdir(args[1]);
         }
     } else if (args[0] == "in") {
+        // -r imports whole dirs
+        bool recursive = args.size() > 1 && args[1] == "-r";
+        if (recursive)
+            args.erase(args.begin() + 1);
+
         if (args.size() < 2) {
             std::cout << "missing path\n";
+        } else if (recursive) {
+            for (auto &path : expandHostPaths(std::vector<std::string>(args.begin() + 1, args.end())))
+                fs->inDir(path);
         } else {
-            fs->in(args[1]);
+            // dirs (and anything else that's not a plain file) are skipped, they're left for in -r
+            std::vector<std::string> paths = expandHostPaths(std::vector<std::string>(args.begin() + 1, args.end()));
+            if (paths.size() == 1) {
+                fs->in(paths[0]);
+            } else if (paths.size() > 1) {
+                fs->in(paths);
+            }
         }
     } else if (args[0] == "out") {
+        // -r exports whole dirs
+        bool recursive = args.size() > 1 && args[1] == "-r";
+        if (recursive)
+            args.erase(args.begin() + 1);
+
         if (args.size() < 2) {
             std::cout << "missing path\n";
-        } else {
+        } else if (recursive) {
+            for (size_t i = 1; i < args.size(); i++)
+                fs->outDir(args[i]);
+        } else if (args.size() == 2 && args[1].find_first_of("*?[") == std::string::npos) {
             fs->out(args[1]);
+        } else {
+            // wildcards are expanded by the file system
+            fs->out(std::vector<std::string>(args.begin() + 1, args.end()));
         }
     } else if (args[0] == "cat") {
         if (args.size() < 2) {
@@ -130,12 +182,17 @@ void Shell::execute(std::vector<std::string> &args) {
             fs->rm(args[1]);
         } 
     } else if (args[0] == "cp") {
+        // --reflink makes the copy share the clusters of the original file
+        bool reflink = args.size() > 1 && args[1] == "--reflink";
+        if (reflink)
+            args.erase(args.begin() + 1);
+
         if (args.size() == 1) {
             std::cout << "missing source file\n";
         } else if (args.size() == 2) {
             std::cout << "missing destination folder\n";
         } else {
-            fs->cp(args[2], args[1]);
+            fs->cp(args[2], args[1], reflink);
         } 
     } else if (args[0] == "mv") {
         if (args.size() == 1) {
@@ -145,8 +202,22 @@ void Shell::execute(std::vector<std::string> &args) {
         } else {
             fs->mv(args[2], args[1]);
         } 
+    } else if (args[0] == "begin") {
+        if (fs->inTransaction()) {
+            std::cout << "transaction already started\n";
+        } else if (fs->begin() == false) {
+            std::cout << "the disk is used by other sessions\n";
+        }
+    } else if (args[0] == "commit") {
+        if (fs->inTransaction() == false) {
+            std::cout << "no transaction to commit\n";
+        } else {
+            fs->commit();
+        }
     } else if (args[0] == "info") {
         fs->info();
+    } else if (args[0] == "sync") {
+        fs->sync();
     } else if (args[0] == "tree") {
         if (args.size() == 1) {
             fs->tree(".");
@@ -156,4 +227,7 @@ void Shell::execute(std::vector<std::string> &args) {
     } else {
         std::cout << "invalid command\n";
     }
+
+    // flush all metadata changes made by the command (unless it's part of a transaction)
+    fs->flush();
 }
\ No newline at end of file
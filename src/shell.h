@@ -17,6 +17,7 @@ private:
 
 private:
     std::vector<std::string> split(std::string str, char separator);
+    std::vector<std::string> expandHostPaths(const std::vector<std::string> &patterns);
     void printPrompt();
     void execute(std::vector<std::string> &args);
     void loadCommands(std::string path);
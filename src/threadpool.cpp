@@ -0,0 +1,80 @@
+#include "threadpool.h"
+
+// the pool and the queue of the worker the calling thread is (if any)
+static thread_local ThreadPool *currentPool = nullptr;
+static thread_local size_t currentQueue = 0;
+
+ThreadPool::ThreadPool(size_t threadCount) : nextQueue(0), queued(0), sleeping(0), stopping(false) {
+    for (size_t i = 0; i < threadCount; i++)
+        queues.emplace_back(new Queue_t);
+    for (size_t i = 0; i < threadCount; i++)
+        workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    // the others are spread over the queues in turns
+    size_t index = currentPool == this ? currentQueue : nextQueue++ % queues.size();
+    {
+        // the task is counted by the time anybody can take it
+        std::lock_guard<std::mutex> queueLock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+        queued++;
+    }
+
+    // a worker going to sleep is counted before it checks queued, so either it sees
+    // the task or it's seen here (taking the mutex makes sure it's already waiting)
+    if (sleeping > 0) {
+        { std::lock_guard<std::mutex> lock(mutex); }
+        taskAvailable.notify_one();
+    }
+}
+
+bool ThreadPool::takeTask(size_t index, std::function<void()> &task) {
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue_t &queue = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+        if (i == 0) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t index) {
+    currentPool = this;
+    currentQueue = index;
+
+    while (true) {
+        std::function<void()> task;
+        if (takeTask(index, task) == false) {
+            // a task counted in queued is in one of the queues, so the worker
+            // only wakes up to look again if there's something to be taken
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping++;
+            taskAvailable.wait(lock, [this] { return stopping || queued > 0; });
+            sleeping--;
+            if (stopping && queued == 0)
+                return;
+            continue;
+        }
+        task();
+    }
+}
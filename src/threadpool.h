@@ -0,0 +1,48 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// every worker has its own queue of tasks - it takes them from the front of its queue
+// and once it runs out, it steals from the back of the others' queues, so workers
+// only contend for a queue when it's about to run dry
+class ThreadPool {
+private:
+    struct Queue_t {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue_t>> queues;
+    std::atomic<size_t> nextQueue;
+
+    // guards the sleeping of idle workers - a task is counted in queued while it's in
+    // one of the queues (it's changed together with the queue, under its mutex), a new
+    // task takes the mutex to wake a worker up only if some of them are sleeping
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> sleeping;
+    bool stopping;
+
+    bool takeTask(size_t index, std::function<void()> &task);
+    void work(size_t index);
+
+public:
+    explicit ThreadPool(size_t threadCount);
+    ~ThreadPool();
+
+    // a task submitted by a worker goes into its own queue (the caller
+    // keeps track of when its tasks are done, e.g. using a latch)
+    void submit(std::function<void()> task);
+};
+
+#endif
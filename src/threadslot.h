@@ -0,0 +1,16 @@
+#ifndef _THREAD_SLOT_H_
+#define _THREAD_SLOT_H_
+
+#include <atomic>
+#include <cstdint>
+
+// a number of its own for every thread, handed out in the order the threads first
+// ask for it - a fixed number of slots is shared by the threads using slot % count,
+// so threads started one after another don't end up in the same slot
+inline uint32_t getThreadSlot() {
+    static std::atomic<uint32_t> threadCount = 0;
+    thread_local uint32_t slot = threadCount++;
+    return slot;
+}
+
+#endif
@@ -0,0 +1,324 @@
+#include <atomic>
+#include <deque>
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "uringdisk.h"
+#include "threadslot.h"
+
+UringDisk::UringDisk(bool useUring) : fd(-1), addr(0), useUring(useUring) {
+}
+
+UringDisk::~UringDisk() {
+    close();
+}
+
+bool UringDisk::diskExists(std::string name) {
+    return access(name.c_str(), R_OK | W_OK) == 0;
+}
+
+void UringDisk::open(std::string name) {
+    fd = ::open(name.c_str(), O_RDWR);
+    assert(fd != -1 && "could not open the disk");
+    addr = 0;
+
+    // the first ring tells whether io_uring can be used at all,
+    // otherwise fall back to a pool of threads doing blocking I/O
+    for (uint32_t i = 0; useUring && i < RING_COUNT; i++) {
+        std::unique_ptr<Ring_t> ring(new Ring_t);
+        if (setupRing(*ring) == false)
+            break;
+        rings.push_back(std::move(ring));
+    }
+    if (rings.empty())
+        pool.reset(new ThreadPool(std::max(2u, std::thread::hardware_concurrency())));
+}
+
+void UringDisk::close() {
+    for (auto &ring : rings)
+        destroyRing(*ring);
+    rings.clear();
+    pool.reset();
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void UringDisk::create(std::string name, uint64_t size) {
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1 && "disk is NULL");
+    int result = ftruncate(fd, size);
+    assert(result == 0 && "creating disk failed");
+    (void)result;
+    ::close(fd);
+}
+
+bool UringDisk::setupRing(Ring_t &ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        return false;
+    }
+
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings with a single mmap
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+
+    ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cqRing = singleMmap ? ring.sqRing : mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    void *sqesMapping = mmap(nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+    if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || sqesMapping == MAP_FAILED) {
+        if (ring.sqRing == MAP_FAILED)
+            ring.sqRing = nullptr;
+        if (ring.cqRing == MAP_FAILED)
+            ring.cqRing = nullptr;
+        if (sqesMapping != MAP_FAILED)
+            munmap(sqesMapping, ring.sqesSize);
+        destroyRing(ring);
+        return false;
+    }
+
+    char *sq = static_cast<char *>(ring.sqRing);
+    char *cq = static_cast<char *>(ring.cqRing);
+    ring.sqes = static_cast<struct io_uring_sqe *>(sqesMapping);
+    ring.sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring.sqEntries = params.sq_entries;
+    ring.cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // the ring is of no use if it can't do vectored reads and writes
+    if (probeOps(ring) == false) {
+        destroyRing(ring);
+        return false;
+    }
+    return true;
+}
+
+bool UringDisk::probeOps(Ring_t &ring) {
+    // the kernels without the probe (before Linux 5.6) are not trusted with them
+    size_t size = sizeof(struct io_uring_probe) + (IORING_OP_LAST + 1) * sizeof(struct io_uring_probe_op);
+    std::unique_ptr<char[]> buffer(new char[size]());
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buffer.get());
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST + 1) < 0)
+        return false;
+
+    for (unsigned op : {IORING_OP_READV, IORING_OP_WRITEV})
+        if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+            return false;
+    return true;
+}
+
+void UringDisk::destroyRing(Ring_t &ring) {
+    if (ring.sqes != nullptr) {
+        munmap(ring.sqes, ring.sqesSize);
+        ring.sqes = nullptr;
+    }
+    if (ring.cqRing != nullptr && ring.cqRing != ring.sqRing)
+        munmap(ring.cqRing, ring.cqRingSize);
+    if (ring.sqRing != nullptr)
+        munmap(ring.sqRing, ring.sqRingSize);
+    ring.sqRing = ring.cqRing = nullptr;
+    if (ring.fd != -1) {
+        ::close(ring.fd);
+        ring.fd = -1;
+    }
+}
+
+void UringDisk::setAddr(uint64_t addr) {
+    assert(fd != -1 && "disk is null");
+    this->addr = addr;
+}
+
+void UringDisk::write(const char *data, size_t size) {
+    writeAt(addr, data, size);
+    addr += size;
+}
+
+void UringDisk::read(char *buffer, size_t size) {
+    readAt(addr, buffer, size);
+    addr += size;
+}
+
+uint64_t UringDisk::getSize() {
+    assert(fd != -1 && "disk is null");
+    struct stat info;
+    int result = fstat(fd, &info);
+    assert(result == 0 && "could not get the size of the disk");
+    (void)result;
+    return info.st_size;
+}
+
+void UringDisk::sync() {
+    assert(fd != -1 && "disk is NULL");
+    int result = fdatasync(fd);
+    assert(result == 0 && "could not sync the disk");
+    (void)result;
+}
+
+void UringDisk::readAt(uint64_t addr, char *buffer, size_t size) {
+    transfer({{addr, buffer, size}}, false);
+}
+
+void UringDisk::writeAt(uint64_t addr, const char *data, size_t size) {
+    transfer({{addr, const_cast<char *>(data), size}}, true);
+}
+
+void UringDisk::readv(const std::vector<IOVec_t> &requests) {
+    transfer(requests, false);
+}
+
+void UringDisk::writev(const std::vector<IOVec_t> &requests) {
+    transfer(requests, true);
+}
+
+void UringDisk::sendTo(int fd, uint64_t addr, size_t size) {
+    assert(this->fd != -1 && "disk is NULL");
+    if (sendFile(this->fd, fd, addr, size) == false)
+        IDiskDriver::sendTo(fd, addr, size);
+}
+
+void UringDisk::copy(uint64_t desAddr, uint64_t srcAddr, size_t size) {
+    assert(fd != -1 && "disk is NULL");
+    if (copyFile(fd, desAddr, srcAddr, size) == false)
+        IDiskDriver::copy(desAddr, srcAddr, size);
+}
+
+UringDisk::Ring_t *UringDisk::getRing() {
+    return rings[getThreadSlot() % rings.size()].get();
+}
+
+void UringDisk::transfer(const std::vector<IOVec_t> &requests, bool write) {
+    assert(fd != -1 && "disk is NULL");
+    if (rings.empty() == false) {
+        Ring_t *ring = getRing();
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        transferUring(*ring, requests, write);
+    } else {
+        transferPool(requests, write);
+    }
+}
+
+void UringDisk::transferUring(Ring_t &ring, const std::vector<IOVec_t> &requests, bool write) {
+    // requests that follow each other on the disk go into a single vectored request,
+    // so a run of clusters doesn't take up an entry of the ring for every cluster
+    struct Run_t {
+        std::vector<struct iovec> iov;
+        size_t first = 0;
+        uint64_t addr = 0;
+        size_t remaining = 0;
+    };
+    std::vector<Run_t> runs;
+    for (size_t i = 0; i < requests.size();) {
+        size_t count = countAdjacent(requests, i);
+        Run_t run;
+        run.addr = requests[i].addr;
+        for (size_t j = i; j < i + count; j++) {
+            if (requests[j].size > 0)
+                run.iov.push_back({requests[j].buffer, requests[j].size});
+            run.remaining += requests[j].size;
+        }
+        if (run.remaining > 0)
+            runs.push_back(std::move(run));
+        i += count;
+    }
+
+    std::deque<size_t> queue;
+    for (size_t i = 0; i < runs.size(); i++)
+        queue.push_back(i);
+    size_t completed = 0;
+    unsigned inFlight = 0;
+    unsigned toSubmit = 0;
+
+    while (completed < runs.size()) {
+        // keep as many requests in flight as the ring allows
+        while (inFlight < ring.sqEntries && !queue.empty()) {
+            size_t i = queue.front();
+            queue.pop_front();
+
+            unsigned tail = *ring.sqTail;
+            unsigned index = tail & *ring.sqMask;
+            struct io_uring_sqe *sqe = &ring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(runs[i].iov.data() + runs[i].first);
+            sqe->len = runs[i].iov.size() - runs[i].first;
+            sqe->off = runs[i].addr;
+            sqe->user_data = i;
+            ring.sqArray[index] = index;
+            __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            inFlight++;
+            toSubmit++;
+        }
+
+        // submit the new requests and wait for at least one of them
+        int submitted = syscall(__NR_io_uring_enter, ring.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        assert(submitted >= 0 && "io_uring_enter failed");
+        toSubmit -= submitted;
+
+        unsigned head = __atomic_load_n(ring.cqHead, __ATOMIC_ACQUIRE);
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            size_t i = cqe->user_data;
+            assert(cqe->res > 0 && "disk I/O failed");
+
+            // a short transfer is queued again for the rest of the run
+            Run_t &run = runs[i];
+            run.addr += cqe->res;
+            run.remaining -= cqe->res;
+            skipTransferred(run.iov, run.first, cqe->res);
+            if (run.remaining == 0) {
+                completed++;
+            } else {
+                queue.push_back(i);
+            }
+            inFlight--;
+            head++;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void UringDisk::transferPool(const std::vector<IOVec_t> &requests, bool write) {
+    // requests that follow each other on the disk go into a single task,
+    // so a run of clusters doesn't turn into a task for every cluster
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < requests.size();) {
+        size_t count = countAdjacent(requests, i);
+        runs.push_back({i, count});
+        i += count;
+    }
+
+    // the pool is shared by all callers, so only the requests of this batch are waited for
+    std::latch batchDone(runs.size());
+    for (auto &run : runs) {
+        pool->submit([this, &requests, run, write, &batchDone] {
+            transferRun(fd, requests.data() + run.first, run.second, write);
+            batchDone.count_down();
+        });
+    }
+    batchDone.wait();
+}
@@ -0,0 +1,85 @@
+#ifndef _URING_DISK_H_
+#define _URING_DISK_H_
+
+#include <mutex>
+#include <latch>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "diskdriver.h"
+#include "threadpool.h"
+
+class UringDisk : public IDiskDriver {
+public:
+    static constexpr uint32_t QUEUE_DEPTH = 64;
+    static constexpr uint32_t RING_COUNT = 8;
+
+private:
+    // io_uring submission and completion rings
+    struct Ring_t {
+        int fd = -1;
+        void *sqRing = nullptr;
+        void *cqRing = nullptr;
+        size_t sqRingSize;
+        size_t cqRingSize;
+        struct io_uring_sqe *sqes = nullptr;
+        size_t sqesSize;
+        unsigned *sqTail;
+        unsigned *sqMask;
+        unsigned *sqArray;
+        unsigned sqEntries;
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned *cqMask;
+        struct io_uring_cqe *cqes;
+
+        // one batch goes through the ring at a time
+        std::mutex mutex;
+    };
+
+    int fd;
+    uint64_t addr;
+    bool useUring;
+
+    // up to RING_COUNT rings are set up by open() and the threads are spread over
+    // them in the order they first submit, so the batches of a few threads don't
+    // wait for one another while the number of rings doesn't grow with the threads
+    std::vector<std::unique_ptr<Ring_t>> rings;
+
+    // used instead of io_uring when it's not available
+    std::unique_ptr<ThreadPool> pool;
+
+    bool setupRing(Ring_t &ring);
+    bool probeOps(Ring_t &ring);
+    void destroyRing(Ring_t &ring);
+    Ring_t *getRing();
+    void transfer(const std::vector<IOVec_t> &requests, bool write);
+    void transferUring(Ring_t &ring, const std::vector<IOVec_t> &requests, bool write);
+    void transferPool(const std::vector<IOVec_t> &requests, bool write);
+
+public:
+    UringDisk(bool useUring = true);
+    ~UringDisk();
+
+    bool diskExists(std::string name) override;
+    void open(std::string name) override;
+    void close() override;
+    void create(std::string name, uint64_t size) override;
+    void setAddr(uint64_t addr) override;
+    void write(const char *data, size_t size) override;
+    void read(char *buffer, size_t size) override;
+    uint64_t getSize() override;
+    void sync() override;
+    void readAt(uint64_t addr, char *buffer, size_t size) override;
+    void writeAt(uint64_t addr, const char *data, size_t size) override;
+    void readv(const std::vector<IOVec_t> &requests) override;
+    void writev(const std::vector<IOVec_t> &requests) override;
+    void sendTo(int fd, uint64_t addr, size_t size) override;
+    void copy(uint64_t desAddr, uint64_t srcAddr, size_t size) override;
+};
+
+#endif
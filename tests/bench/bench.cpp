@@ -0,0 +1,228 @@
+#include <chrono>
+#include <random>
+#include <thread>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+
+#include "fat32.h"
+#include "session.h"
+#include "mounttable.h"
+#include "disk.h"
+#include "mmapdisk.h"
+
+// runs the same sequence of commands on disks with different cluster sizes (with the engine
+// compiled for the geometry and with the generic one), then measures how
+// imports into separate dirs scale with the number of threads and how importing
+// many files with a single command compares to importing them one by one and
+// how a script replayed as one transaction compares to flushing after every command
+
+static constexpr uint32_t DISK_SIZE = MB(512);
+static constexpr uint32_t DIR_COUNT = 2000;
+static constexpr uint32_t FILE_COUNT = 20;
+static constexpr uint32_t FILE_SIZE = MB(1);
+static constexpr uint32_t ROUNDS = 5;
+static constexpr uint32_t IMPORT_FILES = 64;
+static constexpr uint32_t IMPORT_FILE_SIZE = KB(256);
+static constexpr uint32_t SCRIPT_DIRS = 500;
+static constexpr uint32_t SCRIPT_FILE_SIZE = KB(1);
+
+static void runCommands(Session &fs) {
+    fs.mkdir("/d");
+    for (uint32_t i = 0; i < DIR_COUNT; i++) {
+        fs.mkdir("/d/d" + std::to_string(i));
+        fs.mkdir("/d/d" + std::to_string(i) + "/s");
+    }
+
+    // there are more dirs than the dir cache holds, so most of them are read from the disk again
+    for (uint32_t i = 0; i < DIR_COUNT; i++) {
+        fs.cd("/d/d" + std::to_string(i) + "/s");
+        fs.cd("/");
+    }
+    for (uint32_t i = 0; i < FILE_COUNT; i++) {
+        std::string dir = "/f" + std::to_string(i);
+        fs.mkdir(dir);
+        fs.cd(dir);
+        fs.in("data.bin");
+        fs.cp(dir + "/copy", dir + "/data.bin", false);
+        fs.rm(dir + "/copy");
+        fs.cd("/");
+    }
+    for (uint32_t i = 0; i < DIR_COUNT; i++) {
+        fs.rmdir("/d/d" + std::to_string(i) + "/s");
+        fs.rmdir("/d/d" + std::to_string(i));
+    }
+    fs.sync();
+}
+
+// creates a new disk on the given driver and times the commands run in a session bound to it
+static std::chrono::duration<double> timeSession(IDiskDriver *disk, const FAT32::Geometry_t &geometry, bool specialized,
+                                                 const std::function<void(Session &)> &commands) {
+    std::filesystem::remove(FAT32::DISK_FILE_NAME);
+    MountTable mounts;
+    FAT32 *fs = mounts.mount(FAT32::DISK_FILE_NAME, disk, geometry, FAT32::TABLE_CACHE_PAGES, specialized);
+    std::chrono::duration<double> time;
+
+    // the session must be gone before the file system it's bound to
+    {
+        Session session(fs);
+        auto start = std::chrono::steady_clock::now();
+        commands(session);
+        time = std::chrono::steady_clock::now() - start;
+    }
+
+    mounts.unmount(FAT32::DISK_FILE_NAME);
+    return time;
+}
+
+static double measure(const FAT32::Geometry_t &geometry, bool specialized) {
+    std::chrono::duration<double, std::milli> time = timeSession(new MmapDisk, geometry, specialized, runCommands);
+    return time.count();
+}
+
+static double measureImports(uint32_t threadCount) {
+    std::filesystem::remove(FAT32::DISK_FILE_NAME);
+    FAT32::Geometry_t geometry = {DISK_SIZE, KB(4), FAT32::DEFAULT_MAX_NAME_LEN};
+    MountTable mounts;
+    FAT32 *fs = mounts.mount(FAT32::DISK_FILE_NAME, new MmapDisk, geometry);
+    std::vector<std::thread> threads;
+
+    // every thread has a session (and so a working dir) of its own
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < threadCount; i++) {
+        threads.emplace_back([fs, i] {
+            Session session(fs);
+            std::string dir = "/t" + std::to_string(i);
+            session.mkdir(dir);
+            session.cd(dir);
+            for (uint32_t j = 0; j < IMPORT_FILES; j++)
+                session.in("import" + std::to_string(j));
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    fs->sync();
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+    mounts.unmount(FAT32::DISK_FILE_NAME);
+    return static_cast<double>(threadCount) * IMPORT_FILES * IMPORT_FILE_SIZE / MB(1) / time.count();
+}
+
+static double measureBulkImport(bool bulk) {
+    FAT32::Geometry_t geometry = {DISK_SIZE, KB(4), FAT32::DEFAULT_MAX_NAME_LEN};
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < IMPORT_FILES; i++)
+        paths.push_back("import" + std::to_string(i));
+
+    std::chrono::duration<double> time = timeSession(new MmapDisk, geometry, true, [&](Session &session) {
+        if (bulk) {
+            session.in(paths);
+        } else {
+            for (auto &path : paths)
+                session.in(path);
+        }
+        session.sync();
+    });
+    return static_cast<double>(IMPORT_FILES) * IMPORT_FILE_SIZE / MB(1) / time.count();
+}
+
+// replays the commands the way the shell does (with the default driver, every
+// command followed by a flush), either as they come or in one transaction
+static double measureScript(bool transaction) {
+    FAT32::Geometry_t geometry = {DISK_SIZE, KB(4), FAT32::DEFAULT_MAX_NAME_LEN};
+    std::chrono::duration<double, std::milli> time = timeSession(new Disk, geometry, true, [&](Session &session) {
+        if (transaction)
+            session.begin();
+        for (uint32_t i = 0; i < SCRIPT_DIRS; i++) {
+            std::string dir = "/s" + std::to_string(i);
+            session.mkdir(dir);
+            session.flush();
+            session.cd(dir);
+            session.in("small.bin");
+            session.flush();
+            session.cp(dir + "/copy", dir + "/small.bin", false);
+            session.flush();
+            session.mv("/moved" + std::to_string(i), dir + "/copy");
+            session.flush();
+            session.rm(dir + "/small.bin");
+            session.flush();
+            session.cd("/");
+        }
+        if (transaction)
+            session.commit();
+    });
+    return time.count();
+}
+
+int main() {
+    std::filesystem::path workDir = std::filesystem::temp_directory_path() / "fat32bench";
+    std::filesystem::create_directories(workDir);
+    std::filesystem::current_path(workDir);
+
+    // the file imported into the file system
+    std::vector<char> data(FILE_SIZE);
+    std::mt19937 random(42);
+    for (auto &byte : data)
+        byte = static_cast<char>(random());
+    std::ofstream("data.bin", std::ios::binary).write(data.data(), data.size());
+    for (uint32_t i = 0; i < IMPORT_FILES; i++)
+        std::ofstream("import" + std::to_string(i), std::ios::binary).write(data.data(), IMPORT_FILE_SIZE);
+    std::ofstream("small.bin", std::ios::binary).write(data.data(), SCRIPT_FILE_SIZE);
+
+    std::cout << std::setw(16) << "cluster size [B]" << std::setw(20) << "specialized [ms]"
+              << std::setw(16) << "generic [ms]" << std::setw(12) << "speedup" << '\n';
+    for (uint32_t clusterSize : {FAT32::DEFAULT_CLUSTER_SIZE, 512u, static_cast<uint32_t>(KB(4)), static_cast<uint32_t>(KB(64))}) {
+        FAT32::Geometry_t geometry = {DISK_SIZE, clusterSize, FAT32::DEFAULT_MAX_NAME_LEN};
+        double specialized = 0;
+        double generic = 0;
+
+        // the rounds alternate between the two engines so they're measured under the same conditions
+        for (uint32_t round = 0; round < ROUNDS; round++) {
+            double time = measure(geometry, true);
+            specialized = round == 0 ? time : std::min(specialized, time);
+            time = measure(geometry, false);
+            generic = round == 0 ? time : std::min(generic, time);
+        }
+        std::cout << std::fixed << std::setprecision(2) << std::setw(16) << clusterSize << std::setw(20) << specialized
+                  << std::setw(16) << generic << std::setw(12) << generic / specialized << '\n';
+    }
+
+    std::cout << '\n' << std::setw(16) << "threads" << std::setw(20) << "imports [MB/s]" << '\n';
+    for (uint32_t threadCount : {1, 2, 4, 8}) {
+        double throughput = 0;
+        for (uint32_t round = 0; round < ROUNDS; round++)
+            throughput = std::max(throughput, measureImports(threadCount));
+        std::cout << std::setw(16) << threadCount << std::setw(20) << throughput << '\n';
+    }
+
+    std::cout << '\n' << std::setw(16) << "imports" << std::setw(20) << "one by one [MB/s]"
+              << std::setw(16) << "bulk [MB/s]" << '\n';
+    double oneByOne = 0;
+    double bulk = 0;
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        oneByOne = std::max(oneByOne, measureBulkImport(false));
+        bulk = std::max(bulk, measureBulkImport(true));
+    }
+    std::cout << std::setw(16) << IMPORT_FILES << std::setw(20) << oneByOne << std::setw(16) << bulk << '\n';
+
+    std::cout << '\n' << std::setw(16) << "script dirs" << std::setw(20) << "per command [ms]"
+              << std::setw(20) << "transaction [ms]" << '\n';
+    double perCommand = 0;
+    double transaction = 0;
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        double time = measureScript(false);
+        perCommand = round == 0 ? time : std::min(perCommand, time);
+        time = measureScript(true);
+        transaction = round == 0 ? time : std::min(transaction, time);
+    }
+    std::cout << std::setw(16) << SCRIPT_DIRS << std::setw(20) << perCommand << std::setw(20) << transaction << '\n';
+
+    std::filesystem::current_path(workDir.parent_path());
+    std::filesystem::remove_all(workDir);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+# kills the program in the middle of a transaction on a disk whose FAT doesn't fit into
+# the pages given to it (-t) and checks the disk is left as it was when the transaction
+# started, then commits the same transaction and checks the FAT is back within its pages
+# - run from tests/ once the program is built, e.g. ./kill.sh or ./kill.sh -d uring
+set -eu
+
+BIN=$(pwd)/../fat32
+DATA=$(pwd)/data
+PAGES=16
+OPTIONS="-i kill.dat -t $PAGES $*"
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+cd $WORK
+
+# what the transaction starts from
+{
+    echo "mkdir /files"
+    echo "cd /files"
+    echo "in $DATA/zero"
+    echo "in $DATA/random"
+    echo "in $DATA/poem.jpg"
+    for i in $(seq 300); do
+        echo "mkdir /d$i"
+    done
+    echo "mkdir /empty"
+} | $BIN $OPTIONS > /dev/null
+summary() {
+    printf 'tree /\ninfo\n' | $BIN $OPTIONS | grep -E '^ *(\||\[)|free clusters|shared clusters'
+}
+summary > before.txt
+
+# the transaction changes more pages of the FAT and more dirs than are kept in memory
+transaction() {
+    echo "begin"
+    echo "cd /files"
+    echo "in $DATA/vid1.wbm"
+    echo "in $DATA/vid2.wbm"
+    echo "rm /files/zero"
+    echo "cp --reflink /files/random /files/clone"
+    echo "mv /files/poem.jpg /d1/poem.jpg"
+    for i in $(seq 300); do
+        echo "cd /d$i"
+        echo "in $DATA/test.txt"
+    done
+    echo "rmdir /empty"
+    echo "out /d1/poem.jpg"
+}
+mkfifo commands
+$BIN $OPTIONS < commands > /dev/null &
+PID=$!
+exec 3> commands
+transaction >&3
+
+# the shell is killed once it has exported the last file, without committing anything
+while ! cmp -s poem.jpg $DATA/poem.jpg; do
+    kill -0 $PID
+    sleep 0.1
+done
+kill -9 $PID
+wait $PID || true
+exec 3>&-
+rm poem.jpg
+
+summary > after.txt
+printf 'out /files/random\nout /files/poem.jpg\n' | $BIN $OPTIONS > /dev/null
+RESTORED=yes
+diff before.txt after.txt && cmp random $DATA/random && cmp poem.jpg $DATA/poem.jpg || RESTORED=no
+rm -f poem.jpg
+
+# the pages held past the limit are given back by the commit
+LOADED=$({ transaction; echo "commit"; echo "info"; } | $BIN $OPTIONS | grep -o 'FAT pages loaded : [0-9]*' | grep -o '[0-9]*$')
+if [ $RESTORED = yes ] && [ "$LOADED" -le $PAGES ]; then
+    echo "OK"
+else
+    echo "FAILED"
+    exit 1
+fi